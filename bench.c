@@ -0,0 +1,705 @@
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef FS_VERSION
+#define FS_VERSION "unknown"
+#endif
+
+#define DIR "bench.d"
+#define SMALL DIR "/small.bin"
+#define LARGE DIR "/large.bin"
+#define SHORT DIR "/short.txt"
+#define LONG DIR "/long.txt"
+#define WORK DIR "/work"
+#define WORK2 DIR "/work2"
+#define ZWORK DIR "/work.gz"
+#define MANY DIR "/many"
+#define NMANY 1000
+
+#define MIN_ITERS 3
+#define MAX_ITERS 10000
+#define MAX_SECONDS 0.25
+#define SKIP -1
+
+static long small_size = 4 * 1024;
+static long large_size = 32 * 1024 * 1024;
+static long short_lines = 200000;
+static long long_lines = 20000;
+
+static char many[NMANY][64];
+static struct fs_batch_op ops[NMANY];
+static int rcs[NMANY];
+static char scratch[FILENAME_MAX];
+static FILE *fp_a;
+static FILE *fp_b;
+static FILE *fp_out;
+static int fd;
+static long cnt;
+static char **lines;
+static unsigned char *data;
+static long size;
+
+static void teardown(void);
+
+static void die(char const *what, int rc)
+{
+    fprintf(stderr, "bench: %s: %s\n", what, fs_strerror(rc));
+    teardown();
+    exit(1);
+}
+
+static void check(char const *what, int rc)
+{
+    if (rc) die(what, rc);
+}
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void gen_binary(char const *path, long n)
+{
+    unsigned char *buf = malloc(n);
+    if (!buf) die(path, FS_ENOMEM);
+    unsigned x = 2463534242u;
+    for (long i = 0; i < n; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (unsigned char)x;
+    }
+    check(path, fs_writeall(path, n, buf));
+    free(buf);
+}
+
+static void gen_text(char const *path, long nlines, int width)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp) die(path, FS_EFOPEN);
+    unsigned x = 88172645u;
+    for (long i = 0; i < nlines; ++i)
+    {
+        for (int j = 0; j < width; ++j)
+        {
+            x = x * 1103515245u + 12345u;
+            fputc('a' + (x >> 16) % 26, fp);
+        }
+        fputc('\n', fp);
+    }
+    if (fclose(fp)) die(path, FS_EFCLOSE);
+}
+
+static void free_lines(void)
+{
+    for (long i = 0; i < cnt; ++i)
+        free(lines[i]);
+    free(lines);
+    lines = NULL;
+    cnt = 0;
+}
+
+static void nop(void) {}
+
+static void prep_open_large(void)
+{
+    if (!(fp_a = fopen(LARGE, "rb"))) die(LARGE, FS_EFOPEN);
+}
+
+static void done_close_a(void) { fclose(fp_a); }
+
+static void prep_open_fd(void)
+{
+    if (!(fp_a = fopen(LARGE, "rb"))) die(LARGE, FS_EFOPEN);
+    fd = fileno(fp_a);
+}
+
+static void prep_touch_work(void) { check(WORK, fs_touch(WORK)); }
+
+static void prep_mkdir_work(void)
+{
+    if (mkdir(WORK, 0755)) die(WORK, FS_EINVAL);
+}
+
+static void prep_copy_large(void) { check(WORK, fs_copy(WORK, LARGE)); }
+
+static void prep_copy_short(void) { check(WORK, fs_copy(WORK, SHORT)); }
+
+static void prep_copy_long(void) { check(WORK, fs_copy(WORK, LONG)); }
+
+static void done_unlink_work(void) { fs_unlink(WORK); }
+
+static void done_unlink_work2(void) { fs_unlink(WORK2); }
+
+static void done_unlink_scratch(void) { fs_unlink(scratch); }
+
+static void done_free_data(void)
+{
+    free(data);
+    data = NULL;
+}
+
+static void prep_copy_fp(void)
+{
+    if (!(fp_a = fopen(LARGE, "rb"))) die(LARGE, FS_EFOPEN);
+    if (!(fp_out = fopen(WORK, "wb"))) die(WORK, FS_EFOPEN);
+}
+
+static void done_copy_fp(void)
+{
+    fclose(fp_a);
+    fclose(fp_out);
+    fs_unlink(WORK);
+}
+
+static void prep_join(void)
+{
+    if (!(fp_a = fopen(SHORT, "rb"))) die(SHORT, FS_EFOPEN);
+    if (!(fp_b = fopen(LONG, "rb"))) die(LONG, FS_EFOPEN);
+    if (!(fp_out = fopen(WORK, "wb"))) die(WORK, FS_EFOPEN);
+}
+
+static void done_join(void)
+{
+    fclose(fp_a);
+    fclose(fp_b);
+    fclose(fp_out);
+    fs_unlink(WORK);
+}
+
+static void prep_split(void)
+{
+    if (!(fp_a = fopen(SHORT, "rb"))) die(SHORT, FS_EFOPEN);
+    if (!(fp_b = fopen(WORK, "wb"))) die(WORK, FS_EFOPEN);
+    if (!(fp_out = fopen(WORK2, "wb"))) die(WORK2, FS_EFOPEN);
+}
+
+static void done_split(void)
+{
+    done_join();
+    fs_unlink(WORK2);
+}
+
+static void prep_xjoin(void)
+{
+    check(WORK, fs_copy(WORK, SHORT));
+    if (!(fp_a = fopen(WORK, "rb+"))) die(WORK, FS_EFOPEN);
+    if (!(fp_b = fopen(LONG, "rb"))) die(LONG, FS_EFOPEN);
+}
+
+static void prep_xjoin_right(void)
+{
+    check(WORK, fs_copy(WORK, LONG));
+    if (!(fp_a = fopen(SHORT, "rb"))) die(SHORT, FS_EFOPEN);
+    if (!(fp_b = fopen(WORK, "rb+"))) die(WORK, FS_EFOPEN);
+}
+
+static void done_xjoin(void)
+{
+    fclose(fp_a);
+    fclose(fp_b);
+    fs_unlink(WORK);
+}
+
+static void prep_readlines_short(void)
+{
+    check(SHORT, fs_readlines(SHORT, &cnt, &lines));
+}
+
+static void prep_readall_large(void)
+{
+    check(LARGE, fs_readall(LARGE, &size, &data));
+}
+
+static void prep_tmpfile(void) { check("fs_tmpfile", fs_tmpfile(DIR, &fd)); }
+
+static void done_tmplink(void)
+{
+    close(fd);
+    fs_unlink(WORK);
+}
+
+static void done_close_fd(void) { close(fd); }
+
+static void prep_many_ops(int op)
+{
+    for (int i = 0; i < NMANY; ++i)
+        ops[i] = (struct fs_batch_op){op, many[i], NULL, FS_OWNER, FS_EXEC,
+                                      true};
+}
+
+static void prep_batch_touch(void) { prep_many_ops(FS_OP_TOUCH); }
+
+static void prep_batch_setperm(void) { prep_many_ops(FS_OP_SETPERM); }
+
+static void prep_batch_unlink(void)
+{
+    prep_many_ops(FS_OP_TOUCH);
+    check("fs_batch", fs_batch(NMANY, ops, 0, rcs));
+    prep_many_ops(FS_OP_UNLINK);
+}
+
+static void done_batch_unlink(void)
+{
+    prep_many_ops(FS_OP_TOUCH);
+    check("fs_batch", fs_batch(NMANY, ops, 0, rcs));
+}
+
+static int run_size(void) { return fs_size(LARGE, &size); }
+static int run_size_fp(void) { return fs_size_fp(fp_a, &size); }
+static int run_size_fd(void) { return fs_size_fd(fd, &size); }
+
+static int run_getperm(void)
+{
+    bool value = false;
+    int rc = fs_getperm(LARGE, FS_OWNER, FS_READ, &value);
+    return rc == FS_EINVAL ? FS_OK : rc;
+}
+
+static int run_setperm(void)
+{
+    return fs_setperm(LARGE, FS_OWNER, FS_READ, true);
+}
+
+static int run_tell(void) { return fs_tell(fp_a, &size); }
+static int run_seek(void) { return fs_seek(fp_a, 4096, SEEK_SET); }
+static int run_copy_small(void) { return fs_copy(WORK, SMALL); }
+static int run_copy_large(void) { return fs_copy(WORK, LARGE); }
+static int run_copy_fp(void) { return fs_copy_fp(fp_out, fp_a); }
+static int run_unlink(void) { return fs_unlink(WORK); }
+static int run_rmdir(void) { return fs_rmdir(WORK); }
+static int run_mkstemp(void) { return fs_mkstemp(sizeof scratch, scratch); }
+static int run_move(void) { return fs_move(WORK2, WORK); }
+
+static int run_refopen(void)
+{
+    FILE *fp = NULL;
+    int rc = fs_refopen(fp_a, "rb", &fp);
+    if (fp) fclose(fp);
+    return rc;
+}
+
+static int run_fileno(void) { return fs_fileno(fp_a, &fd); }
+
+static int run_getpath(void)
+{
+    return fs_getpath(fp_a, sizeof scratch, scratch);
+}
+
+static int run_exists(void) { return fs_exists(LARGE) ? FS_OK : FS_EINVAL; }
+static int run_isdir(void) { return fs_isdir(DIR) ? FS_OK : FS_EINVAL; }
+static int run_touch(void) { return fs_touch(WORK); }
+
+static int run_readall_small(void)
+{
+    return fs_readall(SMALL, &size, &data);
+}
+
+static int run_readall_large(void)
+{
+    return fs_readall(LARGE, &size, &data);
+}
+
+static int run_writeall_large(void) { return fs_writeall(WORK, size, data); }
+
+static int run_strerror(void)
+{
+    return fs_strerror(FS_ENOMEM)[0] ? FS_OK : FS_EINVAL;
+}
+
+static int run_join(void) { return fs_join(fp_a, fp_b, fp_out); }
+
+static int run_split(void)
+{
+    return fs_split(fp_a, short_lines / 2, fp_b, fp_out);
+}
+
+static int run_readlines_short(void)
+{
+    int rc = fs_readlines(SHORT, &cnt, &lines);
+    free_lines();
+    return rc;
+}
+
+static int run_readlines_long(void)
+{
+    int rc = fs_readlines(LONG, &cnt, &lines);
+    free_lines();
+    return rc;
+}
+
+static int run_writelines(void) { return fs_writelines(WORK, cnt, lines); }
+static int run_ljoin(void) { return fs_ljoin(fp_a, fp_b); }
+static int run_rjoin(void) { return fs_rjoin(fp_a, fp_b); }
+static int run_sort(void) { return fs_sort(WORK); }
+
+static int run_cksum_small(void)
+{
+    return fs_cksum(SMALL, FS_FLETCHER16, &size);
+}
+
+static int run_cksum_large(void)
+{
+    return fs_cksum(LARGE, FS_FLETCHER16, &size);
+}
+
+static int run_durable(void)
+{
+    struct fs_durable *d = NULL;
+    static unsigned char buf[4096];
+    int rc = fs_durable_begin(&d);
+    if (rc) return rc;
+    for (int i = 0; i < NMANY && !rc; ++i)
+        rc = fs_durable_writeall(d, many[i], sizeof buf, buf);
+    if (rc)
+    {
+        fs_durable_abort(d);
+        return rc;
+    }
+    return fs_durable_commit(d);
+}
+
+static int run_tmpfile(void) { return fs_tmpfile(DIR, &fd); }
+static int run_tmplink(void)
+{
+    // Without O_TMPFILE there is nothing to link.
+    int rc = fs_tmplink(fd, WORK);
+    return rc == FS_EINVAL ? SKIP : rc;
+}
+
+static int run_tmppool(void)
+{
+    FILE *fp = NULL;
+    int rc = fs_tmppool_get(&fp);
+    return rc ? rc : fs_tmppool_put(fp);
+}
+
+static int run_batch(void) { return fs_batch(NMANY, ops, 0, rcs); }
+
+// Benchmarks of the codecs only make sense when one is compiled in.
+#ifdef FS_WITH_ZLIB
+static int run_zopen_write(void)
+{
+    FILE *fp = NULL;
+    int rc = fs_zopen(ZWORK, "wb", 0, &fp);
+    if (rc) return rc;
+    if (fwrite(data, 1, size, fp) < (size_t)size) rc = FS_EFWRITE;
+    if (fclose(fp) && !rc) rc = FS_EFCLOSE;
+    return rc;
+}
+
+static int run_zopen_read(void)
+{
+    FILE *fp = NULL;
+    int rc = fs_zopen(ZWORK, "rb", 0, &fp);
+    if (rc) return rc;
+    static char buf[64 * 1024];
+    while (fread(buf, 1, sizeof buf, fp) > 0)
+        ;
+    if (ferror(fp)) rc = FS_EFREAD;
+    fclose(fp);
+    return rc;
+}
+
+static int run_zdetect(void)
+{
+    int codec = 0;
+    return fs_zdetect(ZWORK, &codec);
+}
+
+static int run_readlines_z(void)
+{
+    int rc = fs_readlines(ZWORK, &cnt, &lines);
+    free_lines();
+    return rc;
+}
+
+static void prep_zshort(void)
+{
+    check(SHORT, fs_readall(SHORT, &size, &data));
+    check(ZWORK, run_zopen_write());
+    done_free_data();
+}
+
+static void done_unlink_zwork(void) { fs_unlink(ZWORK); }
+#endif
+
+static int map_count(char const *line, long size, struct fs_emit *out,
+                     void *local)
+{
+    (void)line;
+    (void)out;
+    *(long *)local += size;
+    return FS_OK;
+}
+
+static int map_copy(char const *line, long size, struct fs_emit *out,
+                    void *local)
+{
+    (void)local;
+    int rc = fs_emit(out, line, size);
+    return rc ? rc : fs_emit(out, "\n", 1);
+}
+
+static void *map_init(void *arg)
+{
+    (void)arg;
+    return calloc(1, sizeof(long));
+}
+
+static int map_reduce(void *local, void *arg)
+{
+    *(long *)arg += *(long *)local;
+    free(local);
+    return FS_OK;
+}
+
+static int run_map_count(void)
+{
+    struct fs_mapper m = {map_count, map_init, map_reduce, &size, NULL, 0, 0};
+    size = 0;
+    return fs_map_lines(SHORT, &m);
+}
+
+static int run_map_ordered(void)
+{
+    struct fs_mapper m = {map_copy, NULL, NULL, NULL, fp_out, 0, 0};
+    return fs_map_lines(SHORT, &m);
+}
+
+static void prep_map_ordered(void)
+{
+    if (!(fp_out = fopen(WORK, "wb"))) die(WORK, FS_EFOPEN);
+}
+
+static void done_map_ordered(void)
+{
+    fclose(fp_out);
+    fs_unlink(WORK);
+}
+
+static int run_stats_snapshot(void)
+{
+    static struct fs_stats st;
+    int rc = fs_stats_snapshot(&st);
+    return rc == FS_EINVAL ? FS_OK : rc;
+}
+
+static int run_stats_reset(void)
+{
+    fs_stats_reset();
+    return FS_OK;
+}
+
+static void done_free_lines(void) { free_lines(); }
+
+struct bench
+{
+    char const *name;
+    char const *input;
+    long *bytes;
+    void (*prep)(void);
+    int (*run)(void);
+    void (*done)(void);
+};
+
+static long zero;
+static long short_bytes;
+static long long_bytes;
+static long join_bytes;
+static long many_bytes = NMANY * 4096L;
+
+static struct bench benches[] = {
+    {"fs_size", "large", &zero, nop, run_size, nop},
+    {"fs_size_fp", "large", &zero, prep_open_large, run_size_fp, done_close_a},
+    {"fs_size_fd", "large", &zero, prep_open_fd, run_size_fd, done_close_a},
+    {"fs_getperm", "large", &zero, nop, run_getperm, nop},
+    {"fs_setperm", "large", &zero, nop, run_setperm, nop},
+    {"fs_tell", "large", &zero, prep_open_large, run_tell, done_close_a},
+    {"fs_seek", "large", &zero, prep_open_large, run_seek, done_close_a},
+    {"fs_copy", "small", &small_size, nop, run_copy_small, done_unlink_work},
+    {"fs_copy", "large", &large_size, nop, run_copy_large, done_unlink_work},
+    {"fs_copy_fp", "large", &large_size, prep_copy_fp, run_copy_fp,
+     done_copy_fp},
+    {"fs_unlink", "empty", &zero, prep_touch_work, run_unlink, nop},
+    {"fs_rmdir", "empty", &zero, prep_mkdir_work, run_rmdir, nop},
+    {"fs_mkstemp", "empty", &zero, nop, run_mkstemp, done_unlink_scratch},
+    {"fs_move", "large", &zero, prep_copy_large, run_move, done_unlink_work2},
+    {"fs_refopen", "large", &zero, prep_open_large, run_refopen,
+     done_close_a},
+    {"fs_fileno", "large", &zero, prep_open_large, run_fileno, done_close_a},
+    {"fs_getpath", "large", &zero, prep_open_large, run_getpath,
+     done_close_a},
+    {"fs_exists", "large", &zero, nop, run_exists, nop},
+    {"fs_isdir", "dir", &zero, nop, run_isdir, nop},
+    {"fs_touch", "empty", &zero, nop, run_touch, done_unlink_work},
+    {"fs_readall", "small", &small_size, nop, run_readall_small,
+     done_free_data},
+    {"fs_readall", "large", &large_size, nop, run_readall_large,
+     done_free_data},
+    {"fs_writeall", "large", &large_size, prep_readall_large,
+     run_writeall_large, done_free_data},
+    {"fs_strerror", "none", &zero, nop, run_strerror, nop},
+    {"fs_join", "short+long", &join_bytes, prep_join, run_join, done_join},
+    {"fs_split", "short", &short_bytes, prep_split, run_split, done_split},
+    {"fs_readlines", "short", &short_bytes, nop, run_readlines_short, nop},
+    {"fs_readlines", "long", &long_bytes, nop, run_readlines_long, nop},
+    {"fs_writelines", "short", &short_bytes, prep_readlines_short,
+     run_writelines, done_free_lines},
+    {"fs_ljoin", "short+long", &join_bytes, prep_xjoin, run_ljoin,
+     done_xjoin},
+    {"fs_rjoin", "short+long", &join_bytes, prep_xjoin_right, run_rjoin,
+     done_xjoin},
+    {"fs_sort", "short", &short_bytes, prep_copy_short, run_sort,
+     done_unlink_work},
+    {"fs_sort", "long", &long_bytes, prep_copy_long, run_sort,
+     done_unlink_work},
+    {"fs_cksum", "small", &small_size, nop, run_cksum_small, nop},
+    {"fs_cksum", "large", &large_size, nop, run_cksum_large, nop},
+    {"fs_durable_commit", "many", &many_bytes, nop, run_durable, nop},
+    {"fs_tmpfile", "empty", &zero, nop, run_tmpfile, done_close_fd},
+    {"fs_tmplink", "empty", &zero, prep_tmpfile, run_tmplink, done_tmplink},
+    {"fs_tmppool_get+put", "empty", &zero, nop, run_tmppool, nop},
+    {"fs_batch", "many:touch", &zero, prep_batch_touch, run_batch, nop},
+    {"fs_batch", "many:setperm", &zero, prep_batch_setperm, run_batch, nop},
+    {"fs_batch", "many:unlink", &zero, prep_batch_unlink, run_batch,
+     done_batch_unlink},
+#ifdef FS_WITH_ZLIB
+    {"fs_zopen:write", "large", &large_size, prep_readall_large,
+     run_zopen_write, done_free_data},
+    {"fs_zopen:read", "large.gz", &large_size, nop, run_zopen_read, nop},
+    {"fs_zdetect", "large.gz", &zero, nop, run_zdetect, nop},
+    {"fs_readlines", "short.gz", &short_bytes, prep_zshort, run_readlines_z,
+     done_unlink_zwork},
+#endif
+    {"fs_map_lines:reduce", "short", &short_bytes, nop, run_map_count, nop},
+    {"fs_map_lines:ordered", "short", &short_bytes, prep_map_ordered,
+     run_map_ordered, done_map_ordered},
+    {"fs_stats_snapshot", "none", &zero, nop, run_stats_snapshot, nop},
+    {"fs_stats_reset", "none", &zero, nop, run_stats_reset, nop},
+};
+
+static int cmp_long(void const *a, void const *b)
+{
+    long x = *(long const *)a;
+    long y = *(long const *)b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(long n, long const *sorted, int p)
+{
+    long i = (n * p + 99) / 100 - 1;
+    return sorted[i < 0 ? 0 : i];
+}
+
+static void measure(struct bench const *b, long *lat, bool first)
+{
+    long n = 0;
+    long total = 0;
+    long begin = now_ns();
+    // The time budget covers prep and done as well, otherwise benchmarks
+    // with an expensive setup would always spin up to MAX_ITERS.
+    while (n < MAX_ITERS &&
+           (n < MIN_ITERS || now_ns() - begin < MAX_SECONDS * 1e9))
+    {
+        b->prep();
+        long start = now_ns();
+        int rc = b->run();
+        lat[n] = now_ns() - start;
+        if (rc == SKIP)
+        {
+            b->done();
+            printf("%s    {\"name\": \"%s\", \"input\": \"%s\", "
+                   "\"skipped\": true}",
+                   first ? "" : ",\n", b->name, b->input);
+            fflush(stdout);
+            return;
+        }
+        if (rc) die(b->name, rc);
+        b->done();
+        total += lat[n++];
+    }
+    qsort(lat, n, sizeof(*lat), cmp_long);
+
+    double secs = total / 1e9;
+    printf("%s    {\"name\": \"%s\", \"input\": \"%s\", \"iterations\": %ld, "
+           "\"bytes\": %ld, \"mean_ns\": %ld, \"min_ns\": %ld, "
+           "\"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, "
+           "\"max_ns\": %ld, \"ops_per_s\": %.1f, \"mb_per_s\": %.1f}",
+           first ? "" : ",\n", b->name, b->input, n, *b->bytes, total / n,
+           lat[0], percentile(n, lat, 50), percentile(n, lat, 90),
+           percentile(n, lat, 99), lat[n - 1], secs > 0 ? n / secs : 0.0,
+           secs > 0 ? *b->bytes * (double)n / secs / 1e6 : 0.0);
+    fflush(stdout);
+}
+
+static void setup(void)
+{
+    if (mkdir(DIR, 0755) && !fs_isdir(DIR)) die(DIR, FS_EINVAL);
+    if (mkdir(MANY, 0755) && !fs_isdir(MANY)) die(MANY, FS_EINVAL);
+    gen_binary(SMALL, small_size);
+    gen_binary(LARGE, large_size);
+    gen_text(SHORT, short_lines, 15);
+    gen_text(LONG, long_lines, 1000);
+    check(SHORT, fs_size(SHORT, &short_bytes));
+    check(LONG, fs_size(LONG, &long_bytes));
+    join_bytes = short_bytes + long_bytes;
+    for (int i = 0; i < NMANY; ++i)
+    {
+        sprintf(many[i], MANY "/%d.txt", i);
+        check(many[i], fs_touch(many[i]));
+    }
+}
+
+static void teardown(void)
+{
+    prep_many_ops(FS_OP_UNLINK);
+    fs_batch(NMANY, ops, 0, rcs);
+    fs_rmdir(MANY);
+    fs_unlink(SMALL);
+    fs_unlink(LARGE);
+    fs_unlink(SHORT);
+    fs_unlink(LONG);
+    fs_unlink(WORK);
+    fs_rmdir(WORK);
+    fs_unlink(WORK2);
+    fs_unlink(ZWORK);
+    fs_rmdir(DIR);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) large_size = atol(argv[1]) * 1024 * 1024;
+    if (large_size <= 0)
+    {
+        fprintf(stderr, "usage: %s [large_file_mib]\n", argv[0]);
+        return 1;
+    }
+
+    long *lat = malloc(MAX_ITERS * sizeof(*lat));
+    if (!lat) die("malloc", FS_ENOMEM);
+
+    setup();
+    printf("{\n  \"version\": \"%s\",\n  \"benchmarks\": [\n", FS_VERSION);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i)
+        measure(&benches[i], lat, i == 0);
+    printf("\n  ]\n}\n");
+    teardown();
+
+    free(lat);
+    return 0;
+}
@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
 #undef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L
@@ -10,11 +14,15 @@
 
 #include "fs.h"
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __APPLE__
@@ -33,6 +41,10 @@
 #include <sys/sendfile.h>
 #endif
 
+#ifdef FS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
 #define BUFFSIZE (8 * 1024)
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define LINESIZE BUFFSIZE
@@ -43,6 +55,137 @@ static char *error_strings[] = {
 #undef X
 };
 
+static char const *stat_names[] = {
+#define X(_, A) A,
+    FS_STAT_MAP(X)
+#undef X
+};
+
+// Instrumentation is compiled in with -DFS_STATS. Counters are updated with
+// relaxed atomics; latency[i] counts calls that took [2^i, 2^(i+1)) ns. Each
+// thread adds to one of STAT_SHARDS cache-aligned copies of the table, so
+// that workers of fs_batch and friends do not fight over the same lines, and
+// fs_stats_snapshot sums the shards. SYSCALL counts the system calls a
+// function issues itself; functions that only go through stdio report
+// FS_STAT_UNMEASURED instead.
+static bool const stat_syscalls[FS_STAT_SIZE] = {
+    [FS_STAT_BATCH] = true,
+    [FS_STAT_COPY] = true,
+    [FS_STAT_DURABLE_COMMIT] = true,
+    [FS_STAT_MOVE] = true,
+    [FS_STAT_TMPFILE] = true,
+};
+
+#ifdef FS_STATS
+#define STAT_SHARDS 16
+
+struct stat_shard
+{
+    struct fs_stat op[FS_STAT_SIZE];
+} __attribute__((aligned(64)));
+
+static struct stat_shard stats[STAT_SHARDS];
+static int stat_next;
+static _Thread_local struct stat_shard *stat_mine;
+
+static struct fs_stat *_fs_stat(int id)
+{
+    if (!stat_mine)
+    {
+        int i = __atomic_fetch_add(&stat_next, 1, __ATOMIC_RELAXED);
+        stat_mine = &stats[i % STAT_SHARDS];
+    }
+    return &stat_mine->op[id];
+}
+
+static uint64_t _fs_stat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int _fs_stat_record(int id, uint64_t start, int rc)
+{
+    uint64_t ns = _fs_stat_now() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= FS_STAT_BUCKETS) bucket = FS_STAT_BUCKETS - 1;
+
+    struct fs_stat *st = _fs_stat(id);
+    __atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+    if (rc) __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->nanoseconds, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->latency[bucket], 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+#define STAT_START(t) uint64_t t = _fs_stat_now()
+#define STAT_STOP(id, t, rc) _fs_stat_record(id, t, rc)
+#define STAT_ADD(id, field, n)                                                 \
+    __atomic_fetch_add(&_fs_stat(id)->field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define SYSCALL(id, expr) (STAT_ADD(id, syscalls, 1), (expr))
+#else
+#define STAT_START(t) ((void)0)
+#define STAT_STOP(id, t, rc) (rc)
+#define STAT_ADD(id, field, n) ((void)(n))
+#define SYSCALL(id, expr) ((void)(id), (expr))
+#endif
+
+int fs_stats_snapshot(struct fs_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < FS_STAT_SIZE; ++i)
+    {
+        out->op[i].name = stat_names[i];
+        if (!stat_syscalls[i]) out->op[i].syscalls = FS_STAT_UNMEASURED;
+    }
+
+#ifdef FS_STATS
+    for (int k = 0; k < STAT_SHARDS; ++k)
+    {
+        for (int i = 0; i < FS_STAT_SIZE; ++i)
+        {
+            struct fs_stat *dst = &out->op[i];
+            struct fs_stat *src = &stats[k].op[i];
+            dst->calls += __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+            dst->errors += __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+            dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+            if (stat_syscalls[i])
+                dst->syscalls +=
+                    __atomic_load_n(&src->syscalls, __ATOMIC_RELAXED);
+            dst->nanoseconds +=
+                __atomic_load_n(&src->nanoseconds, __ATOMIC_RELAXED);
+            for (int j = 0; j < FS_STAT_BUCKETS; ++j)
+                dst->latency[j] +=
+                    __atomic_load_n(&src->latency[j], __ATOMIC_RELAXED);
+        }
+    }
+    return FS_OK;
+#else
+    return FS_EINVAL;
+#endif
+}
+
+void fs_stats_reset(void)
+{
+#ifdef FS_STATS
+    for (int k = 0; k < STAT_SHARDS; ++k)
+    {
+        for (int i = 0; i < FS_STAT_SIZE; ++i)
+        {
+            struct fs_stat *st = &stats[k].op[i];
+            __atomic_store_n(&st->calls, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&st->errors, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&st->bytes, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&st->syscalls, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&st->nanoseconds, 0, __ATOMIC_RELAXED);
+            for (int j = 0; j < FS_STAT_BUCKETS; ++j)
+                __atomic_store_n(&st->latency[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+}
+
 int fs_size(char const *filepath, long *size)
 {
     struct stat st = {0};
@@ -102,32 +245,40 @@ int fs_getperm(char const *path, int who, int perm, bool *value)
     return FS_EINVAL;
 }
 
-int fs_setperm(char const *path, int who, int perm, bool value)
+static int _fs_setmode(mode_t *mode, int who, int perm, bool value)
 {
-    struct stat st;
-    if (stat(path, &st)) return FS_ESTAT;
-
     if (who == FS_OWNER && perm == FS_READ)
-        st.st_mode = (st.st_mode & ~S_IRUSR) | (value ? S_IRUSR : 0);
+        *mode = (*mode & ~S_IRUSR) | (value ? S_IRUSR : 0);
     else if (who == FS_OWNER && perm == FS_WRITE)
-        st.st_mode = (st.st_mode & ~S_IWUSR) | (value ? S_IWUSR : 0);
+        *mode = (*mode & ~S_IWUSR) | (value ? S_IWUSR : 0);
     else if (who == FS_OWNER && perm == FS_EXEC)
-        st.st_mode = (st.st_mode & ~S_IXUSR) | (value ? S_IXUSR : 0);
+        *mode = (*mode & ~S_IXUSR) | (value ? S_IXUSR : 0);
     else if (who == FS_GROUP && perm == FS_READ)
-        st.st_mode = (st.st_mode & ~S_IRGRP) | (value ? S_IRGRP : 0);
+        *mode = (*mode & ~S_IRGRP) | (value ? S_IRGRP : 0);
     else if (who == FS_GROUP && perm == FS_WRITE)
-        st.st_mode = (st.st_mode & ~S_IWGRP) | (value ? S_IWGRP : 0);
+        *mode = (*mode & ~S_IWGRP) | (value ? S_IWGRP : 0);
     else if (who == FS_GROUP && perm == FS_EXEC)
-        st.st_mode = (st.st_mode & ~S_IXGRP) | (value ? S_IXGRP : 0);
+        *mode = (*mode & ~S_IXGRP) | (value ? S_IXGRP : 0);
     else if (who == FS_ALL && perm == FS_READ)
-        st.st_mode = (st.st_mode & ~S_IROTH) | (value ? S_IROTH : 0);
+        *mode = (*mode & ~S_IROTH) | (value ? S_IROTH : 0);
     else if (who == FS_ALL && perm == FS_WRITE)
-        st.st_mode = (st.st_mode & ~S_IWOTH) | (value ? S_IWOTH : 0);
+        *mode = (*mode & ~S_IWOTH) | (value ? S_IWOTH : 0);
     else if (who == FS_ALL && perm == FS_EXEC)
-        st.st_mode = (st.st_mode & ~S_IXOTH) | (value ? S_IXOTH : 0);
+        *mode = (*mode & ~S_IXOTH) | (value ? S_IXOTH : 0);
     else
         return FS_EINVAL;
 
+    return FS_OK;
+}
+
+int fs_setperm(char const *path, int who, int perm, bool value)
+{
+    struct stat st;
+    if (stat(path, &st)) return FS_ESTAT;
+
+    int rc = _fs_setmode(&st.st_mode, who, perm, value);
+    if (rc) return rc;
+
     return chmod(path, st.st_mode) ? FS_ECHMOD : FS_OK;
 }
 
@@ -141,16 +292,16 @@ int fs_seek(FILE *restrict fp, long offset, int whence)
     return fseeko(fp, (off_t)offset, whence) < 0 ? FS_EFSEEK : FS_OK;
 }
 
-int fs_copy(char const *dst, char const *src)
+static int _fs_copy(char const *dst, char const *src)
 {
     int input = 0;
     int output = 0;
 
-    if ((input = open(src, O_RDONLY)) == -1)
+    if ((input = SYSCALL(FS_STAT_COPY, open(src, O_RDONLY))) == -1)
     {
         return FS_EOPEN;
     }
-    if ((output = creat(dst, 0660)) == -1)
+    if ((output = SYSCALL(FS_STAT_COPY, creat(dst, 0660))) == -1)
     {
         close(input);
         return FS_ECREAT;
@@ -159,17 +310,19 @@ int fs_copy(char const *dst, char const *src)
     // Here we use kernel-space copying for performance reasons
 #if defined(__APPLE__) || defined(__FreeBSD__)
     // fcopyfile works on FreeBSD and OS X 10.5+
-    if (fcopyfile(input, output, 0, COPYFILE_ALL))
+    if (SYSCALL(FS_STAT_COPY, fcopyfile(input, output, 0, COPYFILE_ALL)))
     {
         close(input);
         close(output);
         return FS_EFCOPYFILE;
     }
+    STAT_ADD(FS_STAT_COPY_FCOPYFILE, calls, 1);
 #else
     // sendfile will work with non-socket output (i.e. regular file) on
     // Linux 2.6.33+
     long size = 0;
     int rc = fs_size_fd(input, &size);
+    STAT_ADD(FS_STAT_COPY, syscalls, 2);
     if (rc)
     {
         close(input);
@@ -178,37 +331,55 @@ int fs_copy(char const *dst, char const *src)
     }
     off_t offset = 0;
     ssize_t cnt = (ssize_t)size;
-    if (sendfile(output, input, &offset, cnt) != cnt)
+    if (SYSCALL(FS_STAT_COPY, sendfile(output, input, &offset, cnt)) != cnt)
     {
         close(input);
         close(output);
         return FS_ESENDFILE;
     }
+    STAT_ADD(FS_STAT_COPY_SENDFILE, calls, 1);
+    STAT_ADD(FS_STAT_COPY_SENDFILE, bytes, cnt);
+    STAT_ADD(FS_STAT_COPY, bytes, cnt);
 #endif
 
-    if (close(input))
+    if (SYSCALL(FS_STAT_COPY, close(input)))
     {
         close(output);
         return FS_ECLOSE;
     }
-    return close(output) ? FS_ECLOSE : FS_OK;
+    return SYSCALL(FS_STAT_COPY, close(output)) ? FS_ECLOSE : FS_OK;
 }
 
-int fs_copy_fp(FILE *restrict dst, FILE *restrict src)
+int fs_copy(char const *dst, char const *src)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_COPY, t, _fs_copy(dst, src));
+}
+
+static int _fs_copy_fp(FILE *restrict dst, FILE *restrict src)
 {
     static _Thread_local char buffer[BUFFSIZE];
     size_t n = 0;
+    long total = 0;
     while ((n = fread(buffer, sizeof(*buffer), BUFFSIZE, src)) > 0)
     {
         if (n < BUFFSIZE && ferror(src)) return FS_EFREAD;
 
         if (fwrite(buffer, sizeof(*buffer), n, dst) < n) return FS_EFWRITE;
+        total += (long)n;
     }
     if (ferror(src)) return FS_EFREAD;
 
+    STAT_ADD(FS_STAT_COPY_FP, bytes, total);
     return FS_OK;
 }
 
+int fs_copy_fp(FILE *restrict dst, FILE *restrict src)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_COPY_FP, t, _fs_copy_fp(dst, src));
+}
+
 int fs_unlink(char const *filepath)
 {
     return unlink(filepath) < 0 ? FS_EUNLINK : FS_OK;
@@ -221,6 +392,21 @@ int fs_rmdir(char const *dirpath)
 
 static int concat_path_file(unsigned size, char *dst, const char *path,
                             const char *filename);
+// How _fs_zopen treats input: decode it when possible and read it raw
+// otherwise, decode it or fail, or never decode it.
+enum zopen_how
+{
+    ZOPEN_AUTO,
+    ZOPEN_STRICT,
+    ZOPEN_RAW,
+};
+
+static int _fs_zopen(char const *filepath, char const *mode, FILE **out,
+                     int *codec, int how, int nthreads);
+static int _fs_zdecode(FILE *fp, FILE **out, int *codec, int how,
+                       int nthreads);
+static int _fs_zcreate(char const *filepath, int codec, FILE **out);
+static int _fs_move_entry(char const *dst, char const *src, int nthreads);
 
 int fs_mkstemp(unsigned size, char *filepath)
 {
@@ -233,22 +419,124 @@ int fs_mkstemp(unsigned size, char *filepath)
     return mkstemp(filepath) < 0 ? FS_EMKSTEMP : FS_OK;
 }
 
-int fs_move(char const *restrict dst, char const *restrict src)
+static int _fs_tmpfile(char const *dirpath, int *fd)
 {
-    if (rename(src, dst) == 0) return FS_OK;
-    FILE *fdst = fopen(dst, "wb");
-    if (!fdst) return FS_EFOPEN;
+    if (!dirpath) dirpath = getenv("TMPDIR");
+    if (!dirpath || dirpath[0] == '\0') dirpath = "/tmp";
+
+#ifdef O_TMPFILE
+    // Anonymous inode: no directory entry to create now or to unlink later.
+    *fd = SYSCALL(FS_STAT_TMPFILE, open(dirpath, O_TMPFILE | O_RDWR, 0600));
+    if (*fd >= 0) return FS_OK;
+#endif
 
-    FILE *fsrc = fopen(src, "rb");
-    if (!fsrc)
+    char filepath[FILENAME_MAX] = {0};
+    int rc = concat_path_file(sizeof filepath, filepath, dirpath,
+                              "tmp.XXXXXXXXXX");
+    if (rc) return rc;
+    if ((*fd = SYSCALL(FS_STAT_TMPFILE, mkstemp(filepath))) < 0)
+        return FS_EMKSTEMP;
+    if (SYSCALL(FS_STAT_TMPFILE, unlink(filepath)) < 0)
     {
-        fclose(fdst);
-        return FS_EFOPEN;
+        SYSCALL(FS_STAT_TMPFILE, close(*fd));
+        return FS_EUNLINK;
     }
+    return FS_OK;
+}
 
-    int rc = fs_copy_fp(fdst, fsrc);
-    if (!fclose(fdst) && fclose(fsrc)) fs_unlink(src);
-    return rc;
+int fs_tmpfile(char const *dirpath, int *fd)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_TMPFILE, t, _fs_tmpfile(dirpath, fd));
+}
+
+// Only an O_TMPFILE descriptor can be given a name. The mkstemp fallback of
+// fs_tmpfile has already been unlinked, and linkat refuses to resurrect it, so
+// such descriptors are rejected with FS_EINVAL up front.
+int fs_tmplink(int fd, char const *filepath)
+{
+#if defined(__linux__) && defined(O_TMPFILE)
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) return FS_EFCNTL;
+    if ((flags & O_TMPFILE) != O_TMPFILE) return FS_EINVAL;
+
+    char pathbuf[FILENAME_MAX] = {0};
+    sprintf(pathbuf, "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, pathbuf, AT_FDCWD, filepath, AT_SYMLINK_FOLLOW) < 0)
+        return FS_ELINKAT;
+    return FS_OK;
+#else
+    (void)fd;
+    (void)filepath;
+    return FS_EINVAL;
+#endif
+}
+
+#define TMPPOOL_SIZE 16
+
+static pthread_mutex_t tmppool_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *tmppool[TMPPOOL_SIZE];
+static int tmppool_cnt;
+
+int fs_tmppool_get(FILE **fp)
+{
+    *fp = NULL;
+    pthread_mutex_lock(&tmppool_lock);
+    if (tmppool_cnt > 0) *fp = tmppool[--tmppool_cnt];
+    pthread_mutex_unlock(&tmppool_lock);
+    if (*fp) return FS_OK;
+
+    int fd = -1;
+    int rc = fs_tmpfile(NULL, &fd);
+    if (rc) return rc;
+    if (!(*fp = fdopen(fd, "w+b")))
+    {
+        close(fd);
+        return FS_EFDOPEN;
+    }
+    return FS_OK;
+}
+
+int fs_tmppool_put(FILE *fp)
+{
+    fflush(fp);
+    if (ftruncate(fileno(fp), 0) < 0)
+    {
+        fclose(fp);
+        return FS_EFTRUNCATE;
+    }
+    rewind(fp);
+
+    pthread_mutex_lock(&tmppool_lock);
+    if (tmppool_cnt < TMPPOOL_SIZE)
+    {
+        tmppool[tmppool_cnt++] = fp;
+        fp = NULL;
+    }
+    pthread_mutex_unlock(&tmppool_lock);
+
+    if (fp && fclose(fp)) return FS_EFCLOSE;
+    return FS_OK;
+}
+
+void fs_tmppool_clear(void)
+{
+    pthread_mutex_lock(&tmppool_lock);
+    while (tmppool_cnt > 0)
+        fclose(tmppool[--tmppool_cnt]);
+    pthread_mutex_unlock(&tmppool_lock);
+}
+
+static int _fs_move(char const *restrict dst, char const *restrict src)
+{
+    if (SYSCALL(FS_STAT_MOVE, rename(src, dst)) == 0) return FS_OK;
+    return errno == EXDEV ? _fs_move_entry(dst, src, 0) : FS_ERENAME;
+}
+
+int fs_move(char const *restrict dst, char const *restrict src)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_MOVE, t, _fs_move(dst, src));
 }
 
 int fs_refopen(FILE *fp, char const *mode, FILE **out)
@@ -304,35 +592,80 @@ int fs_touch(char const *filepath)
     return fclose(fp) ? FS_EFCLOSE : FS_OK;
 }
 
-int fs_readall(char const *filepath, long *size, unsigned char **data)
+// Decoded size is unknown up front, so grow the buffer as we go.
+static int _fs_readall_stream(FILE *fp, long *size, unsigned char **data)
+{
+    long cap = 0;
+    size_t n = 0;
+    do
+    {
+        if (*size == cap)
+        {
+            cap = cap ? 2 * cap : 8 * BUFFSIZE;
+            void *ptr = realloc(*data, cap);
+            if (!ptr) return FS_ENOMEM;
+            *data = ptr;
+        }
+        n = fread(*data + *size, 1, cap - *size, fp);
+        *size += (long)n;
+    } while (n > 0);
+
+    return ferror(fp) ? FS_EFREAD : FS_OK;
+}
+
+static int _fs_readall(char const *filepath, long *size, unsigned char **data,
+                       int how)
 {
     *size = 0;
     *data = NULL;
-    int rc = fs_size(filepath, size);
-    if (rc) return rc;
 
-    if (*size == 0) return 0;
-
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) return FS_EFOPEN;
+    FILE *fp = NULL;
+    int codec = FS_CODEC_NONE;
+    int rc = _fs_zopen(filepath, "rb", &fp, &codec, how, 0);
+    if (rc) return rc;
 
-    if (!(*data = malloc(*size)))
+    // Decoded and non-seekable input have no size to allocate for up front.
+    if (codec != FS_CODEC_NONE || fs_size_fp(fp, size))
     {
-        fclose(fp);
-        return FS_ENOMEM;
+        *size = 0;
+        rc = _fs_readall_stream(fp, size, data);
+    }
+    else if (*size > 0)
+    {
+        if (!(*data = malloc(*size)))
+            rc = FS_ENOMEM;
+        else if (fread(*data, *size, 1, fp) < 1)
+            rc = FS_EFREAD;
     }
 
-    if (fread(*data, *size, 1, fp) < 1)
+    if (rc || *size == 0)
     {
         fclose(fp);
         free(*data);
-        return FS_EFREAD;
+        *data = NULL;
+        *size = 0;
+        return rc;
     }
 
+    STAT_ADD(FS_STAT_READALL, bytes, *size);
     return fclose(fp) ? FS_EFCLOSE : FS_OK;
 }
 
-int fs_writeall(char const *filepath, long size, unsigned char *data)
+int fs_readall(char const *filepath, long *size, unsigned char **data)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_READALL, t,
+                     _fs_readall(filepath, size, data, ZOPEN_AUTO));
+}
+
+int fs_readall_raw(char const *filepath, long *size, unsigned char **data)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_READALL, t,
+                     _fs_readall(filepath, size, data, ZOPEN_RAW));
+}
+
+static int _fs_writeall(char const *filepath, long size, unsigned char *data)
 {
     FILE *fp = fopen(filepath, "wb");
     if (!fp) return FS_EFOPEN;
@@ -345,54 +678,84 @@ int fs_writeall(char const *filepath, long size, unsigned char *data)
         return FS_EFWRITE;
     }
 
+    STAT_ADD(FS_STAT_WRITEALL, bytes, size);
     return fclose(fp) ? FS_EFCLOSE : FS_OK;
 }
 
+int fs_writeall(char const *filepath, long size, unsigned char *data)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_WRITEALL, t, _fs_writeall(filepath, size, data));
+}
+
 char const *fs_strerror(int rc)
 {
     if (rc < 0 || rc >= (int)ARRAY_SIZE(error_strings)) return "unknown error";
     return error_strings[rc];
 }
 
-int fs_join(FILE *a, FILE *b, FILE *out)
+static int _fs_join(FILE *a, FILE *b, FILE *out)
 {
     static _Thread_local char line[LINESIZE] = {0};
+    long total = 0;
 
     while (fgets(line, sizeof(line), a))
     {
         if (ferror(a)) return FS_EFGETS;
-        if (fwrite(line, sizeof(*line), strlen(line), out) < 1)
-            return FS_EFWRITE;
+        size_t n = strlen(line);
+        if (fwrite(line, sizeof(*line), n, out) < 1) return FS_EFWRITE;
+        total += (long)n;
     }
     if (ferror(a)) return FS_EFGETS;
 
     while (fgets(line, sizeof(line), b))
     {
         if (ferror(b)) return FS_EFGETS;
-        if (fwrite(line, sizeof(*line), strlen(line), out) < 1)
-            return FS_EFWRITE;
+        size_t n = strlen(line);
+        if (fwrite(line, sizeof(*line), n, out) < 1) return FS_EFWRITE;
+        total += (long)n;
     }
-    return ferror(b) ? FS_EFGETS : FS_OK;
+    if (ferror(b)) return FS_EFGETS;
+
+    STAT_ADD(FS_STAT_JOIN, bytes, total);
+    return FS_OK;
 }
 
-int fs_split(FILE *in, long cut, FILE *a, FILE *b)
+int fs_join(FILE *a, FILE *b, FILE *out)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_JOIN, t, _fs_join(a, b, out));
+}
+
+static int _fs_split(FILE *in, long cut, FILE *a, FILE *b)
 {
     static _Thread_local char line[LINESIZE] = {0};
 
     long i = 0;
+    long total = 0;
     while (fgets(line, sizeof(line), in))
     {
         if (ferror(in)) return FS_EFGETS;
+        size_t n = strlen(line);
         if (i < cut)
         {
-            if (fwrite(line, sizeof(*line), strlen(line), a) < 1)
-                return FS_EFWRITE;
+            if (fwrite(line, sizeof(*line), n, a) < 1) return FS_EFWRITE;
         }
-        else if (fwrite(line, sizeof(*line), strlen(line), b) < 1)
+        else if (fwrite(line, sizeof(*line), n, b) < 1)
             return FS_EFWRITE;
+        total += (long)n;
         ++i;
     }
-    return ferror(in) ? FS_EFGETS : FS_OK;
+    if (ferror(in)) return FS_EFGETS;
+
+    STAT_ADD(FS_STAT_SPLIT, bytes, total);
+    return FS_OK;
+}
+
+int fs_split(FILE *in, long cut, FILE *a, FILE *b)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_SPLIT, t, _fs_split(in, cut, a, b));
 }
 
 static char *_fs_strdup(char const *str);
@@ -404,83 +767,131 @@ static void _fs_readlines_cleanup(long cnt, char *lines[])
     free(lines);
 }
 
-int fs_readlines(char const *filepath, long *cnt, char **lines[])
+static int _fs_readlines(char const *filepath, long *cnt, char **lines[],
+                         int *codec, int how)
 {
     static _Thread_local char line[LINESIZE] = {0};
 
-    FILE *fp = fopen(filepath, "r");
-    if (!fp) return FS_EFOPEN;
+    FILE *fp = NULL;
+    int rc = _fs_zopen(filepath, "r", &fp, codec, how, 0);
+    if (rc) return rc;
 
     *cnt = 0;
     *lines = NULL;
+    long total = 0;
 
     while (fgets(line, sizeof(line), fp))
     {
-        if (ferror(fp)) return FS_EFGETS;
-
-        char **ptr = NULL;
-        if (*cnt == 0)
-        {
-            ptr = malloc((*cnt + 1) * sizeof(*lines));
-            if (!ptr) return FS_ENOMEM;
-        }
-        else
+        char **ptr = realloc(*lines, (*cnt + 1) * sizeof(*lines));
+        if (!ptr)
         {
-            ptr = realloc(*lines, (*cnt + 1) * sizeof(*lines));
-            if (!ptr)
-            {
-                _fs_readlines_cleanup(*cnt, *lines);
-                return FS_ENOMEM;
-            }
+            rc = FS_ENOMEM;
+            break;
         }
+        *lines = ptr;
         char *str = _fs_strdup(line);
         if (!str)
         {
-            _fs_readlines_cleanup(*cnt, *lines);
-            return FS_ENOMEM;
+            rc = FS_ENOMEM;
+            break;
         }
-        *lines = ptr;
         (*lines)[*cnt] = str;
         *cnt += 1;
+        total += (long)strlen(str);
+    }
+    if (!rc && ferror(fp)) rc = FS_EFGETS;
+    fclose(fp);
+
+    if (rc)
+    {
+        _fs_readlines_cleanup(*cnt, *lines);
+        *cnt = 0;
+        *lines = NULL;
+        return rc;
     }
-    return ferror(fp) ? FS_EFGETS : FS_OK;
+
+    STAT_ADD(FS_STAT_READLINES, bytes, total);
+    return FS_OK;
 }
 
-int fs_writelines(char const *filepath, long cnt, char *lines[])
+int fs_readlines(char const *filepath, long *cnt, char **lines[])
 {
-    FILE *fp = fopen(filepath, "w");
-    if (!fp) return FS_EFOPEN;
+    int codec = FS_CODEC_NONE;
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_READLINES, t,
+                     _fs_readlines(filepath, cnt, lines, &codec, ZOPEN_AUTO));
+}
 
-    if (cnt <= 0) return fclose(fp) ? FS_EFCLOSE : FS_OK;
+int fs_readlines_raw(char const *filepath, long *cnt, char **lines[])
+{
+    int codec = FS_CODEC_NONE;
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_READLINES, t,
+                     _fs_readlines(filepath, cnt, lines, &codec, ZOPEN_RAW));
+}
 
+static int _fs_putlines(FILE *fp, long cnt, char *lines[], long *bytes)
+{
+    *bytes = 0;
     for (long i = 0; i < cnt; ++i)
     {
-        if (fputs(lines[i], fp) < 1)
-        {
-            fclose(fp);
-            return FS_EFWRITE;
-        }
+        if (fputs(lines[i], fp) < 1) return FS_EFWRITE;
         size_t n = strlen(lines[i]);
         if (n == 0 || lines[i][n - 1] != '\n')
         {
-            if (fputc('\n', fp) != '\n')
-            {
-                fclose(fp);
-                return FS_EFPUTC;
-            }
+            if (fputc('\n', fp) != '\n') return FS_EFPUTC;
+            *bytes += 1;
         }
+        *bytes += (long)n;
+    }
+    return FS_OK;
+}
+
+static int _fs_writelines(char const *filepath, long cnt, char *lines[])
+{
+    FILE *fp = fopen(filepath, "w");
+    if (!fp) return FS_EFOPEN;
+
+    long bytes = 0;
+    int rc = _fs_putlines(fp, cnt, lines, &bytes);
+    if (rc)
+    {
+        fclose(fp);
+        return rc;
     }
 
+    STAT_ADD(FS_STAT_WRITELINES, bytes, bytes);
     return fclose(fp) ? FS_EFCLOSE : FS_OK;
 }
 
-int fs_ljoin(FILE *left, FILE *right)
+int fs_writelines(char const *filepath, long cnt, char *lines[])
 {
-    FILE *tmp = tmpfile();
-    if (!tmp) return FS_ETMPFILE;
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_WRITELINES, t,
+                     _fs_writelines(filepath, cnt, lines));
+}
+
+static int _fs_zwritelines(char const *filepath, int codec, long cnt,
+                           char *lines[])
+{
+    FILE *fp = NULL;
+    int rc = _fs_zcreate(filepath, codec, &fp);
+    if (rc) return rc;
+
+    long bytes = 0;
+    rc = _fs_putlines(fp, cnt, lines, &bytes);
+    if (fclose(fp) && !rc) rc = FS_EFCLOSE;
+    return rc;
+}
+
+static int _fs_ljoin(FILE *left, FILE *right)
+{
+    FILE *tmp = NULL;
+    int rc = fs_tmppool_get(&tmp);
+    if (rc) return rc;
 
     rewind(left);
-    int rc = fs_copy_fp(tmp, left);
+    rc = fs_copy_fp(tmp, left);
     if (rc) goto cleanup;
 
     rewind(tmp);
@@ -489,17 +900,24 @@ int fs_ljoin(FILE *left, FILE *right)
     rc = fs_join(tmp, right, left);
 
 cleanup:
-    fclose(tmp);
+    fs_tmppool_put(tmp);
     return rc;
 }
 
-int fs_rjoin(FILE *left, FILE *right)
+int fs_ljoin(FILE *left, FILE *right)
 {
-    FILE *tmp = tmpfile();
-    if (!tmp) return FS_ETMPFILE;
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_LJOIN, t, _fs_ljoin(left, right));
+}
+
+static int _fs_rjoin(FILE *left, FILE *right)
+{
+    FILE *tmp = NULL;
+    int rc = fs_tmppool_get(&tmp);
+    if (rc) return rc;
 
     rewind(right);
-    int rc = fs_copy_fp(tmp, right);
+    rc = fs_copy_fp(tmp, right);
     if (rc) goto cleanup;
 
     rewind(tmp);
@@ -508,34 +926,61 @@ int fs_rjoin(FILE *left, FILE *right)
     rc = fs_join(left, tmp, right);
 
 cleanup:
-    fclose(tmp);
+    fs_tmppool_put(tmp);
     return rc;
 }
 
+int fs_rjoin(FILE *left, FILE *right)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_RJOIN, t, _fs_rjoin(left, right));
+}
+
 static int compare(const void *a, const void *b)
 {
     return strcmp(*((char const **)a), *((char const **)b));
 }
 
-int fs_sort(char const *filepath)
+static int _fs_sort(char const *filepath)
 {
     long cnt = 0;
     char **lines = NULL;
+    int codec = FS_CODEC_NONE;
     int rc = FS_OK;
 
-    if ((rc = fs_readlines(filepath, &cnt, &lines))) return rc;
+    STAT_START(t0);
+    rc = _fs_readlines(filepath, &cnt, &lines, &codec, ZOPEN_AUTO);
+    if (STAT_STOP(FS_STAT_SORT_READ, t0, rc)) return rc;
+
+    STAT_START(t1);
     qsort(lines, cnt, sizeof(*lines), &compare);
-    rc = fs_writelines(filepath, cnt, lines);
+    (void)STAT_STOP(FS_STAT_SORT_QSORT, t1, FS_OK);
+
+    // Compressed input is written back compressed. BGZF, the only codec
+    // there is a writer for, is also valid gzip.
+    STAT_START(t2);
+    if (codec == FS_CODEC_NONE)
+        rc = fs_writelines(filepath, cnt, lines);
+    else
+        rc = _fs_zwritelines(filepath, FS_CODEC_BGZF, cnt, lines);
+    (void)STAT_STOP(FS_STAT_SORT_WRITE, t2, rc);
 
     _fs_readlines_cleanup(cnt, lines);
     return rc;
 }
 
+int fs_sort(char const *filepath)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_SORT, t, _fs_sort(filepath));
+}
+
 static int _fs_fletcher16(FILE *fp, uint8_t *buf, size_t bufsize, long *chk)
 {
     size_t n = 0;
     uint16_t sum1 = 0;
     uint16_t sum2 = 0;
+    long total = 0;
     while ((n = fread(buf, 1, bufsize, fp)) > 0)
     {
         if (n < bufsize && ferror(fp)) return FS_EFREAD;
@@ -544,20 +989,23 @@ static int _fs_fletcher16(FILE *fp, uint8_t *buf, size_t bufsize, long *chk)
             sum1 = (sum1 + buf[i]) % 255;
             sum2 = (sum2 + sum1) % 255;
         }
+        total += (long)n;
     }
     if (ferror(fp)) return FS_EFREAD;
 
+    STAT_ADD(FS_STAT_CKSUM, bytes, total);
     *chk = (sum2 << 8) | sum1;
     return FS_OK;
 }
 
-int fs_cksum(char const *filepath, int algo, long *chk)
+static int _fs_cksum(char const *filepath, int algo, long *chk, int how)
 {
     static _Thread_local uint8_t buffer[BUFFSIZE];
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) return FS_EFOPEN;
+    FILE *fp = NULL;
+    int codec = FS_CODEC_NONE;
+    int rc = _fs_zopen(filepath, "rb", &fp, &codec, how, 0);
+    if (rc) return rc;
 
-    int rc = 0;
     if (algo == FS_FLETCHER16)
         rc = _fs_fletcher16(fp, buffer, sizeof(buffer), chk);
     else
@@ -567,6 +1015,2140 @@ int fs_cksum(char const *filepath, int algo, long *chk)
     return rc;
 }
 
+int fs_cksum(char const *filepath, int algo, long *chk)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_CKSUM, t,
+                     _fs_cksum(filepath, algo, chk, ZOPEN_AUTO));
+}
+
+int fs_cksum_raw(char const *filepath, int algo, long *chk)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_CKSUM, t,
+                     _fs_cksum(filepath, algo, chk, ZOPEN_RAW));
+}
+
+// Splits filepath into its parent directory and base name.
+static int _fs_split_path(char const *filepath, unsigned size, char *dirpath,
+                          char const **base)
+{
+    char const *sep = strrchr(filepath, '/');
+    if (!sep)
+    {
+        if (size < 2) return FS_ETRUNCPATH;
+        strcpy(dirpath, ".");
+        *base = filepath;
+    }
+    else if (sep == filepath)
+    {
+        if (size < 2) return FS_ETRUNCPATH;
+        strcpy(dirpath, "/");
+        *base = sep + 1;
+    }
+    else
+    {
+        if (sep - filepath >= (long)size) return FS_ETRUNCPATH;
+        memcpy(dirpath, filepath, sep - filepath);
+        dirpath[sep - filepath] = '\0';
+        *base = sep + 1;
+    }
+    return (*base)[0] == '\0' ? FS_EINVAL : FS_OK;
+}
+
+// Crash-safe writes batched into a commit group: every file goes to a
+// temporary sibling, and fs_durable_commit flushes them all at once before
+// renaming them over their destinations and syncing the parent directories.
+// Directories are only opened while being synced, so a group may span more
+// of them than there are file descriptors to spare.
+struct fs_durable_dir
+{
+    char *path;
+    dev_t dev;
+};
+
+struct fs_durable_item
+{
+    char *tmp;
+    char *dst;
+};
+
+struct fs_durable
+{
+    long cnt;
+    long cap;
+    struct fs_durable_item *items;
+    long ndirs;
+    long dircap;
+    struct fs_durable_dir *dirs;
+    unsigned long seq;
+    int stat;
+};
+
+int fs_durable_begin(struct fs_durable **out)
+{
+    struct fs_durable *d = calloc(1, sizeof(*d));
+    if (!d) return FS_ENOMEM;
+    d->stat = FS_STAT_DURABLE_COMMIT;
+    *out = d;
+    return FS_OK;
+}
+
+// Adds a directory known not to be in the group yet.
+static int _fs_durable_newdir(struct fs_durable *d, char const *dirpath)
+{
+    if (d->ndirs == d->dircap)
+    {
+        long cap = d->dircap ? 2 * d->dircap : 4;
+        void *ptr = realloc(d->dirs, cap * sizeof(*d->dirs));
+        if (!ptr) return FS_ENOMEM;
+        d->dirs = ptr;
+        d->dircap = cap;
+    }
+
+    struct stat st = {0};
+    if (stat(dirpath, &st) < 0) return FS_ESTAT;
+    if (!S_ISDIR(st.st_mode)) return FS_EOPEN;
+
+    struct fs_durable_dir *dir = &d->dirs[d->ndirs];
+    if (!(dir->path = _fs_strdup(dirpath))) return FS_ENOMEM;
+    dir->dev = st.st_dev;
+    d->ndirs += 1;
+    return FS_OK;
+}
+
+static int _fs_durable_dir(struct fs_durable *d, char const *dirpath)
+{
+    for (long i = 0; i < d->ndirs; ++i)
+        if (!strcmp(d->dirs[i].path, dirpath)) return FS_OK;
+    return _fs_durable_newdir(d, dirpath);
+}
+
+// Queues tmppath to be renamed over filepath at commit.
+static int _fs_durable_add(struct fs_durable *d, char const *tmppath,
+                           char const *filepath)
+{
+    if (d->cnt == d->cap)
+    {
+        long cap = d->cap ? 2 * d->cap : 16;
+        void *ptr = realloc(d->items, cap * sizeof(*d->items));
+        if (!ptr) return FS_ENOMEM;
+        d->items = ptr;
+        d->cap = cap;
+    }
+
+    struct fs_durable_item *item = &d->items[d->cnt];
+    item->tmp = _fs_strdup(tmppath);
+    item->dst = _fs_strdup(filepath);
+    if (!item->tmp || !item->dst)
+    {
+        free(item->tmp);
+        free(item->dst);
+        return FS_ENOMEM;
+    }
+    d->cnt += 1;
+    return FS_OK;
+}
+
+static int _fs_durable_open(struct fs_durable *d, char const *filepath,
+                            FILE **fp)
+{
+    char dirpath[FILENAME_MAX] = {0};
+    char tmppath[FILENAME_MAX] = {0};
+    char const *base = NULL;
+    int rc = _fs_split_path(filepath, sizeof dirpath, dirpath, &base);
+    if (rc) return rc;
+
+    rc = _fs_durable_dir(d, dirpath);
+    if (rc) return rc;
+
+    // The temporary file lives next to its destination so that the final
+    // rename never crosses a filesystem boundary.
+    int fd = -1;
+    do
+    {
+        int n = snprintf(tmppath, sizeof(tmppath), "%s/.%s.%ld.%lu.tmp",
+                         dirpath, base, (long)getpid(), d->seq++);
+        if (n < 0 || n >= (int)sizeof(tmppath)) return FS_ETRUNCPATH;
+        fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0) return FS_EOPEN;
+
+    // Replacing a file must not reset its mode to the umask default. The
+    // owner is carried over on a best-effort basis since only privileged
+    // callers may give a file away.
+    struct stat st = {0};
+    if (!stat(filepath, &st))
+    {
+        if (fchmod(fd, st.st_mode & 07777))
+        {
+            close(fd);
+            unlink(tmppath);
+            return FS_ECHMOD;
+        }
+        if (fchown(fd, st.st_uid, st.st_gid)) errno = 0;
+    }
+
+    if (!(*fp = fdopen(fd, "wb")))
+    {
+        close(fd);
+        unlink(tmppath);
+        return FS_EFDOPEN;
+    }
+
+    if ((rc = _fs_durable_add(d, tmppath, filepath)))
+    {
+        fclose(*fp);
+        unlink(tmppath);
+    }
+    return rc;
+}
+
+static int _fs_durable_close(struct fs_durable *d, FILE *fp, int rc)
+{
+    if (fclose(fp) && !rc) rc = FS_EFCLOSE;
+    if (rc)
+    {
+        d->cnt -= 1;
+        unlink(d->items[d->cnt].tmp);
+        free(d->items[d->cnt].tmp);
+        free(d->items[d->cnt].dst);
+    }
+    return rc;
+}
+
+int fs_durable_writeall(struct fs_durable *d, char const *filepath, long size,
+                        unsigned char *data)
+{
+    FILE *fp = NULL;
+    int rc = _fs_durable_open(d, filepath, &fp);
+    if (rc) return rc;
+
+    if (size > 0 && fwrite(data, size, 1, fp) < 1) rc = FS_EFWRITE;
+    return _fs_durable_close(d, fp, rc);
+}
+
+int fs_durable_writelines(struct fs_durable *d, char const *filepath,
+                          long cnt, char *lines[])
+{
+    FILE *fp = NULL;
+    int rc = _fs_durable_open(d, filepath, &fp);
+    if (rc) return rc;
+
+    long bytes = 0;
+    return _fs_durable_close(d, fp, _fs_putlines(fp, cnt, lines, &bytes));
+}
+
+static void _fs_durable_free(struct fs_durable *d, long from)
+{
+    for (long i = from; i < d->cnt; ++i)
+        unlink(d->items[i].tmp);
+    for (long i = 0; i < d->cnt; ++i)
+    {
+        free(d->items[i].tmp);
+        free(d->items[i].dst);
+    }
+    for (long i = 0; i < d->ndirs; ++i)
+        free(d->dirs[i].path);
+    free(d->items);
+    free(d->dirs);
+    free(d);
+}
+
+// Opens path just to fsync it. System calls are counted against stat id.
+static int _fs_durable_fsync(int id, char const *path, int flags)
+{
+    int fd = SYSCALL(id, open(path, flags));
+    if (fd < 0) return FS_EOPEN;
+    int rc = SYSCALL(id, fsync(fd)) < 0 ? FS_EFSYNC : FS_OK;
+    if (SYSCALL(id, close(fd)) && !rc) rc = FS_ECLOSE;
+    return rc;
+}
+
+static int _fs_durable_sync(struct fs_durable *d)
+{
+#ifdef __linux__
+    // One syncfs per filesystem flushes every pending temporary file at once.
+    for (long i = 0; i < d->ndirs; ++i)
+    {
+        bool seen = false;
+        for (long j = 0; j < i && !seen; ++j)
+            seen = d->dirs[j].dev == d->dirs[i].dev;
+        if (seen) continue;
+
+        int flags = O_RDONLY | O_DIRECTORY;
+        int fd = SYSCALL(d->stat, open(d->dirs[i].path, flags));
+        if (fd < 0) return FS_EOPEN;
+        int rc = SYSCALL(d->stat, syncfs(fd)) < 0 ? FS_ESYNCFS : FS_OK;
+        SYSCALL(d->stat, close(fd));
+        if (rc) return rc;
+    }
+#else
+    // A temporary symbolic link has no data of its own to flush.
+    for (long i = 0; i < d->cnt; ++i)
+    {
+        int rc = _fs_durable_fsync(d->stat, d->items[i].tmp,
+                                   O_RDONLY | O_NOFOLLOW);
+        if (rc == FS_EOPEN && errno == ELOOP) continue;
+        if (rc) return rc;
+    }
+#endif
+    return FS_OK;
+}
+
+static int _fs_durable_commit(struct fs_durable *d)
+{
+    int rc = _fs_durable_sync(d);
+    if (rc)
+    {
+        _fs_durable_free(d, 0);
+        return rc;
+    }
+
+    for (long i = 0; i < d->cnt; ++i)
+    {
+        if (SYSCALL(d->stat, rename(d->items[i].tmp, d->items[i].dst)))
+        {
+            _fs_durable_free(d, i);
+            return FS_ERENAME;
+        }
+    }
+
+    for (long i = 0; i < d->ndirs && !rc; ++i)
+        rc = _fs_durable_fsync(d->stat, d->dirs[i].path,
+                               O_RDONLY | O_DIRECTORY);
+
+    _fs_durable_free(d, d->cnt);
+    return rc;
+}
+
+int fs_durable_commit(struct fs_durable *d)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_DURABLE_COMMIT, t, _fs_durable_commit(d));
+}
+
+void fs_durable_abort(struct fs_durable *d) { _fs_durable_free(d, 0); }
+
+static int _fs_nthreads(int nthreads)
+{
+    if (nthreads > 0) return nthreads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Runs fn on nthreads threads, the caller being one of them. Threads that
+// cannot be created are simply not used: fn must share its work through arg.
+static void _fs_parallel(int nthreads, void *(*fn)(void *), void *arg)
+{
+    pthread_t *threads = NULL;
+    int started = 0;
+
+    if (nthreads > 1 && (threads = malloc((nthreads - 1) * sizeof(*threads))))
+    {
+        while (started < nthreads - 1 &&
+               !pthread_create(&threads[started], NULL, fn, arg))
+            ++started;
+    }
+
+    fn(arg);
+
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+#define DIRCACHE_SIZE 8
+
+struct fs_dircache
+{
+    char *path[DIRCACHE_SIZE];
+    int fd[DIRCACHE_SIZE];
+    int next;
+};
+
+static void _fs_dircache_close(struct fs_dircache *c)
+{
+    for (int i = 0; i < DIRCACHE_SIZE; ++i)
+    {
+        if (c->path[i]) SYSCALL(FS_STAT_BATCH, close(c->fd[i]));
+        free(c->path[i]);
+    }
+}
+
+// Resolves the parent directory of filepath to a cached fd so that *at()
+// calls on siblings skip the path walk.
+static int _fs_dircache_at(struct fs_dircache *c, char const *filepath,
+                           int *dirfd, char const **base)
+{
+    char const *sep = strrchr(filepath, '/');
+    if (!sep)
+    {
+        *dirfd = AT_FDCWD;
+        *base = filepath;
+        return FS_OK;
+    }
+    *base = sep + 1;
+
+    size_t len = sep == filepath ? 1 : (size_t)(sep - filepath);
+    for (int i = 0; i < DIRCACHE_SIZE; ++i)
+    {
+        if (c->path[i] && !strncmp(c->path[i], filepath, len) &&
+            c->path[i][len] == '\0')
+        {
+            *dirfd = c->fd[i];
+            return FS_OK;
+        }
+    }
+
+    char *path = malloc(len + 1);
+    if (!path) return FS_ENOMEM;
+    memcpy(path, filepath, len);
+    path[len] = '\0';
+
+    int fd = SYSCALL(FS_STAT_BATCH, open(path, O_RDONLY | O_DIRECTORY));
+    if (fd < 0)
+    {
+        free(path);
+        return FS_EOPEN;
+    }
+
+    int i = c->next;
+    c->next = (c->next + 1) % DIRCACHE_SIZE;
+    if (c->path[i]) SYSCALL(FS_STAT_BATCH, close(c->fd[i]));
+    free(c->path[i]);
+    c->path[i] = path;
+    c->fd[i] = fd;
+    *dirfd = fd;
+    return FS_OK;
+}
+
+// A cross-device move gets nthreads threads of its own to copy with.
+static int _fs_batch_one(struct fs_dircache *c, struct fs_batch_op const *op,
+                         int nthreads)
+{
+    int dirfd = AT_FDCWD;
+    char const *base = NULL;
+    int rc = _fs_dircache_at(c, op->path, &dirfd, &base);
+    if (rc) return rc;
+
+    if (op->op == FS_OP_UNLINK)
+    {
+        if (SYSCALL(FS_STAT_BATCH, unlinkat(dirfd, base, 0)) < 0)
+            return FS_EUNLINK;
+        return FS_OK;
+    }
+
+    if (op->op == FS_OP_TOUCH)
+    {
+        int flags = O_WRONLY | O_CREAT | O_EXCL;
+        int fd = SYSCALL(FS_STAT_BATCH, openat(dirfd, base, flags, 0666));
+        if (fd < 0) return errno == EEXIST ? FS_OK : FS_EOPEN;
+        return SYSCALL(FS_STAT_BATCH, close(fd)) ? FS_ECLOSE : FS_OK;
+    }
+
+    if (op->op == FS_OP_SETPERM)
+    {
+        struct stat st;
+        if (SYSCALL(FS_STAT_BATCH, fstatat(dirfd, base, &st, 0)))
+            return FS_ESTAT;
+        if ((rc = _fs_setmode(&st.st_mode, op->who, op->perm, op->value)))
+            return rc;
+        if (SYSCALL(FS_STAT_BATCH, fchmodat(dirfd, base, st.st_mode, 0)))
+            return FS_ECHMOD;
+        return FS_OK;
+    }
+
+    if (op->op == FS_OP_MOVE)
+    {
+        int dstfd = AT_FDCWD;
+        char const *dstbase = NULL;
+        if ((rc = _fs_dircache_at(c, op->dst, &dstfd, &dstbase))) return rc;
+        // The source directory fd may have been evicted by the lookup above.
+        if ((rc = _fs_dircache_at(c, op->path, &dirfd, &base))) return rc;
+        if (SYSCALL(FS_STAT_BATCH, renameat(dirfd, base, dstfd, dstbase)) == 0)
+            return FS_OK;
+        if (errno != EXDEV) return FS_ERENAME;
+        STAT_START(t);
+        return STAT_STOP(FS_STAT_MOVE, t,
+                         _fs_move_entry(op->dst, op->path, nthreads));
+    }
+
+    return FS_EINVAL;
+}
+
+#define BATCH_CHUNK 32
+
+struct fs_batch
+{
+    long cnt;
+    struct fs_batch_op const *ops;
+    int *rcs;
+    long next;
+    int budget;
+};
+
+static void *_fs_batch_worker(void *arg)
+{
+    struct fs_batch *b = arg;
+    struct fs_dircache cache = {0};
+
+    long i = 0;
+    while ((i = __atomic_fetch_add(&b->next, BATCH_CHUNK, __ATOMIC_RELAXED)) <
+           b->cnt)
+    {
+        long end = i + BATCH_CHUNK < b->cnt ? i + BATCH_CHUNK : b->cnt;
+        for (; i < end; ++i)
+            b->rcs[i] = _fs_batch_one(&cache, &b->ops[i], b->budget);
+    }
+
+    _fs_dircache_close(&cache);
+    return NULL;
+}
+
+static int _fs_batch(long cnt, struct fs_batch_op const ops[], int nthreads,
+                     int rcs[])
+{
+    if (cnt < 0 || !rcs) return FS_EINVAL;
+
+    struct fs_batch b = {cnt, ops, rcs, 0, 1};
+    nthreads = _fs_nthreads(nthreads);
+    if (nthreads > (cnt + BATCH_CHUNK - 1) / BATCH_CHUNK)
+        nthreads = (int)((cnt + BATCH_CHUNK - 1) / BATCH_CHUNK);
+    // Workers share the CPUs with the copies of cross-device moves.
+    if (nthreads > 0 && _fs_nthreads(0) / nthreads > 1)
+        b.budget = _fs_nthreads(0) / nthreads;
+    _fs_parallel(nthreads, &_fs_batch_worker, &b);
+
+    for (long i = 0; i < cnt; ++i)
+        if (rcs[i]) return rcs[i];
+    return FS_OK;
+}
+
+int fs_batch(long cnt, struct fs_batch_op const ops[], int nthreads, int rcs[])
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_BATCH, t, _fs_batch(cnt, ops, nthreads, rcs));
+}
+
+// Cross-device moves, with the semantics of rename. A regular file is copied
+// in MOVE_CHUNK pieces on up to nthreads threads into a temporary sibling of
+// its destination, with copy_file_range where the kernel allows it and
+// pread/pwrite otherwise. Symbolic links are recreated the same way. Mode,
+// ownership and timestamps are carried over, the copy is fsynced and renamed
+// over the destination, and the destination directory is fsynced before the
+// source is unlinked: a failure leaves both the source and any existing
+// destination intact. A directory takes the place of a new or empty one and
+// is moved as a single fs_durable commit group: the whole tree is copied
+// first, then one flush, the renames and one fsync per directory make it
+// durable before any source is removed. A failure while copying removes the
+// copies again.
+#define MOVE_CHUNK (64L * 1024 * 1024)
+#define MOVE_BUFFSIZE (1024 * 1024)
+
+#if defined(__linux__) && defined(__GLIBC__) &&                                \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+struct fs_chunks
+{
+    int in;
+    int out;
+    off_t size;
+    long cnt;
+    long next;
+    int rc;
+};
+
+static int _fs_copy_range(int in, int out, off_t off, off_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    while (len > 0)
+    {
+        off_t off_in = off;
+        off_t off_out = off;
+        ssize_t n = SYSCALL(FS_STAT_MOVE,
+                            copy_file_range(in, &off_in, out, &off_out,
+                                            (size_t)len, 0));
+        // Unsupported pairs of filesystems fail here: finish with pread.
+        if (n <= 0) break;
+        off += n;
+        len -= n;
+    }
+    if (len == 0) return FS_OK;
+#endif
+
+    char *buf = malloc(MOVE_BUFFSIZE);
+    if (!buf) return FS_ENOMEM;
+
+    int rc = FS_OK;
+    while (len > 0 && !rc)
+    {
+        size_t size = len < MOVE_BUFFSIZE ? (size_t)len : MOVE_BUFFSIZE;
+        ssize_t n = SYSCALL(FS_STAT_MOVE, pread(in, buf, size, off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            rc = FS_EPREAD;
+            break;
+        }
+        for (ssize_t done = 0; done < n && !rc;)
+        {
+            ssize_t m = SYSCALL(FS_STAT_MOVE,
+                                pwrite(out, buf + done, n - done, off + done));
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0)
+            {
+                rc = FS_EPWRITE;
+                break;
+            }
+            done += m;
+        }
+        off += n;
+        len -= n;
+    }
+
+    free(buf);
+    return rc;
+}
+
+static void *_fs_chunk_worker(void *arg)
+{
+    struct fs_chunks *c = arg;
+    long i = 0;
+    while ((i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) < c->cnt)
+    {
+        if (__atomic_load_n(&c->rc, __ATOMIC_RELAXED)) break;
+        off_t off = (off_t)i * MOVE_CHUNK;
+        off_t len = c->size - off < MOVE_CHUNK ? c->size - off : MOVE_CHUNK;
+        int rc = _fs_copy_range(c->in, c->out, off, len);
+        if (rc) __atomic_store_n(&c->rc, rc, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int _fs_set_times(int fd, char const *path, struct stat const *st)
+{
+#ifdef __APPLE__
+    struct timespec times[2] = {st->st_atimespec, st->st_mtimespec};
+#else
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+#endif
+    STAT_ADD(FS_STAT_MOVE, syscalls, 1);
+    if (fd >= 0) return futimens(fd, times) ? FS_EFUTIMENS : FS_OK;
+    return utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) ? FS_EFUTIMENS
+                                                                 : FS_OK;
+}
+
+static unsigned long move_seq;
+
+// Names a temporary sibling of filepath, which the caller must create with
+// O_EXCL semantics and retry on EEXIST.
+static int _fs_move_sibling(char const *filepath, char *dirpath,
+                            char *tmppath)
+{
+    char const *base = NULL;
+    int rc = _fs_split_path(filepath, FILENAME_MAX, dirpath, &base);
+    if (rc) return rc;
+
+    unsigned long seq = __atomic_fetch_add(&move_seq, 1, __ATOMIC_RELAXED);
+    int n = snprintf(tmppath, FILENAME_MAX, "%s/.%s.%ld.%lu.tmp", dirpath,
+                     base, (long)getpid(), seq);
+    return n < 0 || n >= FILENAME_MAX ? FS_ETRUNCPATH : FS_OK;
+}
+
+// Ownership is kept when permitted; an unprivileged move keeps the caller's
+// uid, as cp -p does.
+static int _fs_move_owner(int fd, char const *path, struct stat const *st)
+{
+    int rc = fd >= 0 ? fchown(fd, st->st_uid, st->st_gid)
+                     : lchown(path, st->st_uid, st->st_gid);
+    STAT_ADD(FS_STAT_MOVE, syscalls, 1);
+    return rc < 0 && errno != EPERM ? FS_ECHOWN : FS_OK;
+}
+
+// Renames tmppath over dst, then makes the new entry durable before the
+// source is unlinked.
+static int _fs_move_commit(char const *dst, char const *src,
+                           char const *tmppath, char const *dirpath)
+{
+    if (SYSCALL(FS_STAT_MOVE, rename(tmppath, dst)) < 0)
+    {
+        SYSCALL(FS_STAT_MOVE, unlink(tmppath));
+        return FS_ERENAME;
+    }
+    int rc = _fs_durable_fsync(FS_STAT_MOVE, dirpath, O_RDONLY | O_DIRECTORY);
+    if (rc) return rc;
+    return SYSCALL(FS_STAT_MOVE, unlink(src)) < 0 ? FS_EUNLINK : FS_OK;
+}
+
+// Copies src into a new temporary sibling of dst, named in tmppath, with the
+// metadata in st. The copy is fsynced only when sync is set.
+static int _fs_move_copy(char const *dst, char const *src,
+                         struct stat const *st, int nthreads, bool sync,
+                         char *dirpath, char *tmppath)
+{
+    int in = SYSCALL(FS_STAT_MOVE, open(src, O_RDONLY));
+    if (in < 0) return FS_EOPEN;
+
+    int rc = FS_OK;
+    int out = -1;
+    do
+    {
+        if ((rc = _fs_move_sibling(dst, dirpath, tmppath))) break;
+        out = SYSCALL(FS_STAT_MOVE,
+                      open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0600));
+    } while (out < 0 && errno == EEXIST);
+    if (!rc && out < 0) rc = FS_EOPEN;
+    if (rc)
+    {
+        close(in);
+        return rc;
+    }
+
+    struct fs_chunks c = {in, out, st->st_size, 0, 0, FS_OK};
+    c.cnt = (long)((st->st_size + MOVE_CHUNK - 1) / MOVE_CHUNK);
+    if (SYSCALL(FS_STAT_MOVE, ftruncate(out, st->st_size)) < 0)
+        rc = FS_EFTRUNCATE;
+    else
+    {
+        nthreads = _fs_nthreads(nthreads);
+        _fs_parallel(nthreads < c.cnt ? nthreads : (int)c.cnt,
+                     &_fs_chunk_worker, &c);
+        rc = c.rc;
+    }
+
+    if (!rc) rc = _fs_move_owner(out, tmppath, st);
+    if (!rc && SYSCALL(FS_STAT_MOVE, fchmod(out, st->st_mode & 07777)) < 0)
+        rc = FS_ECHMOD;
+    if (!rc) rc = _fs_set_times(out, tmppath, st);
+    if (!rc && sync && SYSCALL(FS_STAT_MOVE, fsync(out)) < 0) rc = FS_EFSYNC;
+    if (SYSCALL(FS_STAT_MOVE, close(out)) && !rc) rc = FS_ECLOSE;
+    SYSCALL(FS_STAT_MOVE, close(in));
+
+    if (rc) SYSCALL(FS_STAT_MOVE, unlink(tmppath));
+    else
+        STAT_ADD(FS_STAT_MOVE, bytes, st->st_size);
+    return rc;
+}
+
+static int _fs_move_file(char const *dst, char const *src,
+                         struct stat const *st, int nthreads)
+{
+    char dirpath[FILENAME_MAX] = {0};
+    char tmppath[FILENAME_MAX] = {0};
+    int rc = _fs_move_copy(dst, src, st, nthreads, true, dirpath, tmppath);
+    return rc ? rc : _fs_move_commit(dst, src, tmppath, dirpath);
+}
+
+// Recreates the symbolic link src as a temporary sibling of dst, named in
+// tmppath.
+static int _fs_move_symlink(char const *dst, char const *src,
+                            struct stat const *st, char *dirpath,
+                            char *tmppath)
+{
+    char *target = malloc(st->st_size + 1);
+    if (!target) return FS_ENOMEM;
+
+    ssize_t n = SYSCALL(FS_STAT_MOVE, readlink(src, target, st->st_size + 1));
+    if (n < 0 || n > st->st_size)
+    {
+        free(target);
+        return FS_EREADLINK;
+    }
+    target[n] = '\0';
+
+    int rc = FS_OK;
+    int err = 0;
+    do
+    {
+        if ((rc = _fs_move_sibling(dst, dirpath, tmppath))) break;
+        err = SYSCALL(FS_STAT_MOVE, symlink(target, tmppath));
+    } while (err < 0 && errno == EEXIST);
+    free(target);
+    if (rc) return rc;
+    if (err < 0) return FS_ESYMLINK;
+
+    rc = _fs_move_owner(-1, tmppath, st);
+    if (!rc) rc = _fs_set_times(-1, tmppath, st);
+    if (rc) SYSCALL(FS_STAT_MOVE, unlink(tmppath));
+    return rc;
+}
+
+static int _fs_move_link(char const *dst, char const *src,
+                         struct stat const *st)
+{
+    char dirpath[FILENAME_MAX] = {0};
+    char tmppath[FILENAME_MAX] = {0};
+    int rc = _fs_move_symlink(dst, src, st, dirpath, tmppath);
+    return rc ? rc : _fs_move_commit(dst, src, tmppath, dirpath);
+}
+
+// The entries of a directory move in pre-order, each with its source
+// metadata. Directories are created in place, everything else is queued in
+// the commit group as a temporary sibling.
+struct fs_move_node
+{
+    char *src;
+    char *dst;
+    struct stat st;
+};
+
+struct fs_move_tree
+{
+    struct fs_durable *d;
+    struct fs_move_node *nodes;
+    long cnt;
+    long cap;
+    int nthreads;
+};
+
+static int _fs_move_push(struct fs_move_tree *t, char const *dst,
+                         char const *src, struct stat const *st)
+{
+    if (t->cnt == t->cap)
+    {
+        long cap = t->cap ? 2 * t->cap : 16;
+        void *ptr = realloc(t->nodes, cap * sizeof(*t->nodes));
+        if (!ptr) return FS_ENOMEM;
+        t->nodes = ptr;
+        t->cap = cap;
+    }
+
+    struct fs_move_node *node = &t->nodes[t->cnt];
+    node->src = _fs_strdup(src);
+    node->dst = _fs_strdup(dst);
+    if (!node->src || !node->dst)
+    {
+        free(node->src);
+        free(node->dst);
+        return FS_ENOMEM;
+    }
+    node->st = *st;
+    t->cnt += 1;
+    return FS_OK;
+}
+
+static int _fs_move_walk(struct fs_move_tree *t, char const *dst,
+                         char const *src, struct stat const *st);
+
+static int _fs_move_mkdir(struct fs_move_tree *t, char const *dst,
+                          char const *src, struct stat const *st)
+{
+    // Like rename, take the place of an empty directory but of nothing else.
+    if (SYSCALL(FS_STAT_MOVE, mkdir(dst, 0700)) < 0 &&
+        (errno != EEXIST || SYSCALL(FS_STAT_MOVE, rmdir(dst)) < 0 ||
+         SYSCALL(FS_STAT_MOVE, mkdir(dst, 0700)) < 0))
+        return FS_EMKDIR;
+
+    int rc = _fs_move_push(t, dst, src, st);
+    if (rc)
+    {
+        SYSCALL(FS_STAT_MOVE, rmdir(dst));
+        return rc;
+    }
+    if ((rc = _fs_durable_newdir(t->d, dst))) return rc;
+
+    DIR *dir = SYSCALL(FS_STAT_MOVE, opendir(src));
+    if (!dir) return FS_EOPENDIR;
+
+    struct dirent *entry = NULL;
+    char srcpath[FILENAME_MAX] = {0};
+    char dstpath[FILENAME_MAX] = {0};
+    while (!rc && (entry = readdir(dir)))
+    {
+        char const *name = entry->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+        if ((rc = concat_path_file(sizeof srcpath, srcpath, src, name))) break;
+        if ((rc = concat_path_file(sizeof dstpath, dstpath, dst, name))) break;
+
+        struct stat sub = {0};
+        if (SYSCALL(FS_STAT_MOVE, lstat(srcpath, &sub)) < 0)
+            rc = FS_ESTAT;
+        else
+            rc = _fs_move_walk(t, dstpath, srcpath, &sub);
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Copies one entry of the tree.
+static int _fs_move_walk(struct fs_move_tree *t, char const *dst,
+                         char const *src, struct stat const *st)
+{
+    if (S_ISDIR(st->st_mode)) return _fs_move_mkdir(t, dst, src, st);
+
+    char dirpath[FILENAME_MAX] = {0};
+    char tmppath[FILENAME_MAX] = {0};
+    int rc = FS_EINVAL;
+    if (S_ISREG(st->st_mode))
+        rc = _fs_move_copy(dst, src, st, t->nthreads, false, dirpath, tmppath);
+    else if (S_ISLNK(st->st_mode))
+        rc = _fs_move_symlink(dst, src, st, dirpath, tmppath);
+    if (rc) return rc;
+
+    if ((rc = _fs_durable_add(t->d, tmppath, dst)))
+    {
+        SYSCALL(FS_STAT_MOVE, unlink(tmppath));
+        return rc;
+    }
+    return _fs_move_push(t, dst, src, st);
+}
+
+// Removes the sources once the copies are durable, deepest entries first, and
+// hands each new directory the metadata of its source on the way up.
+static int _fs_move_finish(struct fs_move_tree *t)
+{
+    for (long i = t->cnt - 1; i >= 0; --i)
+    {
+        struct fs_move_node const *node = &t->nodes[i];
+        if (!S_ISDIR(node->st.st_mode))
+        {
+            if (SYSCALL(FS_STAT_MOVE, unlink(node->src)) < 0)
+                return FS_EUNLINK;
+            continue;
+        }
+
+        int rc = _fs_move_owner(-1, node->dst, &node->st);
+        if (rc) return rc;
+        if (SYSCALL(FS_STAT_MOVE, chmod(node->dst, node->st.st_mode & 07777)))
+            return FS_ECHMOD;
+        if ((rc = _fs_set_times(-1, node->dst, &node->st))) return rc;
+        if (SYSCALL(FS_STAT_MOVE, rmdir(node->src)) < 0) return FS_ERMDIR;
+    }
+    return FS_OK;
+}
+
+static int _fs_move_dir(char const *dst, char const *src,
+                        struct stat const *st, int nthreads)
+{
+    struct fs_move_tree t = {0};
+    t.nthreads = nthreads;
+    int rc = fs_durable_begin(&t.d);
+    if (rc) return rc;
+    t.d->stat = FS_STAT_MOVE;
+
+    char dirpath[FILENAME_MAX] = {0};
+    char const *base = NULL;
+    rc = _fs_split_path(dst, sizeof dirpath, dirpath, &base);
+    if (!rc) rc = _fs_durable_newdir(t.d, dirpath);
+    if (!rc) rc = _fs_move_mkdir(&t, dst, src, st);
+
+    if (rc)
+    {
+        // Directories go last, once the queued copies inside are unlinked.
+        fs_durable_abort(t.d);
+        for (long i = t.cnt - 1; i >= 0; --i)
+            if (S_ISDIR(t.nodes[i].st.st_mode))
+                SYSCALL(FS_STAT_MOVE, rmdir(t.nodes[i].dst));
+    }
+    else if (!(rc = _fs_durable_commit(t.d)))
+        rc = _fs_move_finish(&t);
+
+    for (long i = 0; i < t.cnt; ++i)
+    {
+        free(t.nodes[i].src);
+        free(t.nodes[i].dst);
+    }
+    free(t.nodes);
+    return rc;
+}
+
+static int _fs_move_entry(char const *dst, char const *src, int nthreads)
+{
+    struct stat st = {0};
+    if (SYSCALL(FS_STAT_MOVE, lstat(src, &st)) < 0) return FS_ESTAT;
+
+    if (S_ISREG(st.st_mode)) return _fs_move_file(dst, src, &st, nthreads);
+    if (S_ISDIR(st.st_mode)) return _fs_move_dir(dst, src, &st, nthreads);
+    if (S_ISLNK(st.st_mode)) return _fs_move_link(dst, src, &st);
+    return FS_EINVAL;
+}
+
+// Compressed streams. fs_zopen detects the codec of an input file by its
+// magic bytes and hands back a FILE * that yields the decoded bytes, so the
+// line and bulk APIs work unchanged on compressed data. Those APIs fall back
+// to the raw bytes when a codec is not compiled in, or when the first gzip
+// member does not inflate. zstd is not supported and such input is plain bytes
+// to every API. The sniffed bytes are replayed rather than seeked over, so
+// pipes and FIFOs work too. Other gzip input is decoded as a single stream.
+// BGZF (gzip made of independent blocks, as written by fs_zopen for .gz/.bgz
+// paths) is coded on the caller's thread for the first BGZF_INLINE blocks, so
+// that small files cost no thread start-up. Past that, and when more than one
+// thread is allowed, the stream moves to a pipeline: an I/O thread reads raw
+// blocks into a ring, or writes finished ones out of it, while the workers
+// asked for in fs_zopen inflate or deflate the blocks in between. Closing a
+// BGZF reader that is blocked on an idle pipe waits for its I/O thread.
+#define ZBUFSIZE (64 * 1024)
+#define ZPROBE 4096
+#define GZIP_HEADER 10
+#define BGZF_BLOCK 0xff00
+#define BGZF_MAX 0x10000
+#define BGZF_HEADER 18
+#define BGZF_FOOTER 8
+#define BGZF_RING 4
+#define BGZF_INLINE 2
+#define ZMAGIC BGZF_HEADER
+
+struct bgzf_block
+{
+    unsigned char raw[BGZF_MAX];
+    unsigned char data[BGZF_MAX];
+    size_t raw_size;
+    size_t data_size;
+    int rc;
+    bool done;
+};
+
+struct zstream
+{
+    FILE *fp;
+    unsigned char probe[ZPROBE];
+    size_t nprobe;
+    size_t ppos;
+    int codec;
+    int nthreads;
+    bool writing;
+    bool eof;
+    bool inside;
+    unsigned char *in;
+#ifdef FS_WITH_ZLIB
+    z_stream zs;
+#endif
+    // BGZF blocks go through block on the caller's thread until nblocks
+    // reaches BGZF_INLINE and more than one thread is allowed.
+    struct bgzf_block *block;
+    long nblocks;
+    // BGZF ring: blocks [tail, head) are in flight, [tail, work) have been
+    // claimed by a worker. end is the number of blocks read once known.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t io;
+    pthread_t *workers;
+    int nworkers;
+    struct bgzf_block *blocks;
+    long cap;
+    long head;
+    long work;
+    long tail;
+    long end;
+    size_t pos;
+    bool filling;
+    bool closing;
+    bool stop;
+    int rc;
+};
+
+struct codec
+{
+    int (*open)(struct zstream *);
+    ssize_t (*read)(struct zstream *, char *buf, size_t size);
+    ssize_t (*write)(struct zstream *, char const *buf, size_t size);
+    int (*close)(struct zstream *);
+};
+
+static int _fs_codec_detect(unsigned char const *magic, size_t size)
+{
+    // RFC 1952: deflate is the only method and the top FLG bits are reserved.
+    if (size < GZIP_HEADER || magic[0] != 0x1f || magic[1] != 0x8b ||
+        magic[2] != 8 || (magic[3] & 0xe0))
+        return FS_CODEC_NONE;
+    if (size >= BGZF_HEADER && (magic[3] & 4) &&
+        magic[10] == 6 && magic[11] == 0 && magic[12] == 'B' &&
+        magic[13] == 'C' && magic[14] == 2 && magic[15] == 0)
+        return FS_CODEC_BGZF;
+    return FS_CODEC_GZIP;
+}
+
+// Reads from the underlying file, starting with the sniffed bytes.
+static size_t _fs_zfread(struct zstream *z, void *buf, size_t size)
+{
+    size_t n = z->nprobe - z->ppos;
+    if (n > size) n = size;
+    memcpy(buf, z->probe + z->ppos, n);
+    z->ppos += n;
+    if (n < size) n += fread((char *)buf + n, 1, size - n, z->fp);
+    return n;
+}
+
+static int _fs_raw_open(struct zstream *z)
+{
+    (void)z;
+    return FS_OK;
+}
+
+static ssize_t _fs_raw_read(struct zstream *z, char *buf, size_t size)
+{
+    size_t n = _fs_zfread(z, buf, size);
+    return ferror(z->fp) ? -1 : (ssize_t)n;
+}
+
+static int _fs_raw_close(struct zstream *z)
+{
+    (void)z;
+    return FS_OK;
+}
+
+static struct codec const raw_codec = {&_fs_raw_open, &_fs_raw_read, NULL,
+                                       &_fs_raw_close};
+
+#ifdef FS_WITH_ZLIB
+static uint32_t _fs_le32(unsigned char const *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[3] << 24;
+}
+
+static void _fs_put_le32(unsigned char *p, uint32_t x)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = (x >> 24) & 0xff;
+}
+
+// Whether the first gzip member in data inflates, as far as data goes. Binary
+// data that merely starts like a gzip header fails within a few bytes.
+static bool _fs_gzip_probe(unsigned char const *data, size_t size, bool eof)
+{
+    unsigned char out[4096];
+    z_stream zs = {0};
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) return true;
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)size;
+    int rc = Z_OK;
+    while (rc == Z_OK)
+    {
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        rc = inflate(&zs, Z_NO_FLUSH);
+    }
+    inflateEnd(&zs);
+    // Z_BUF_ERROR: the probe ran out before the member did.
+    return rc == Z_STREAM_END || (rc == Z_BUF_ERROR && !eof);
+}
+
+static int _fs_gzip_open(struct zstream *z)
+{
+    if (!(z->in = malloc(ZBUFSIZE))) return FS_ENOMEM;
+    // 15 + 32: gzip or zlib wrapper with automatic header detection.
+    if (inflateInit2(&z->zs, 15 + 32) != Z_OK)
+    {
+        free(z->in);
+        return FS_ENOMEM;
+    }
+    return FS_OK;
+}
+
+static ssize_t _fs_gzip_read(struct zstream *z, char *buf, size_t size)
+{
+    if (size > UINT_MAX) size = UINT_MAX;
+    z->zs.next_out = (Bytef *)buf;
+    z->zs.avail_out = (uInt)size;
+
+    while (z->zs.avail_out > 0)
+    {
+        if (z->zs.avail_in == 0 && !z->eof)
+        {
+            size_t n = _fs_zfread(z, z->in, ZBUFSIZE);
+            if (ferror(z->fp)) return -1;
+            if (n == 0) z->eof = true;
+            z->zs.next_in = z->in;
+            z->zs.avail_in = (uInt)n;
+        }
+
+        int rc = inflate(&z->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END)
+        {
+            // Concatenated members form a single stream.
+            z->inside = false;
+            inflateReset(&z->zs);
+        }
+        else if (rc == Z_BUF_ERROR)
+        {
+            if (z->eof) break;
+        }
+        else if (rc == Z_OK)
+            z->inside = true;
+        else
+            return -1;
+    }
+
+    size_t n = size - z->zs.avail_out;
+    return n == 0 && z->inside ? -1 : (ssize_t)n;
+}
+
+static int _fs_gzip_close(struct zstream *z)
+{
+    inflateEnd(&z->zs);
+    free(z->in);
+    return FS_OK;
+}
+
+static int _fs_bgzf_inflate(z_stream *zs, struct bgzf_block *b)
+{
+    if (inflateReset(zs) != Z_OK) return FS_EFREAD;
+
+    zs->next_in = b->raw + BGZF_HEADER;
+    zs->avail_in = (uInt)(b->raw_size - BGZF_HEADER - BGZF_FOOTER);
+    zs->next_out = b->data;
+    zs->avail_out = BGZF_MAX;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) return FS_EFREAD;
+
+    b->data_size = BGZF_MAX - zs->avail_out;
+    unsigned char const *footer = b->raw + b->raw_size - BGZF_FOOTER;
+    if (_fs_le32(footer + 4) != b->data_size) return FS_EFREAD;
+    if (_fs_le32(footer) !=
+        crc32(crc32(0, NULL, 0), b->data, (uInt)b->data_size))
+        return FS_EFREAD;
+    return FS_OK;
+}
+
+static int _fs_bgzf_deflate(z_stream *zs, struct bgzf_block *b)
+{
+    // Incompressible data may not fit in a block: store it instead.
+    int rc = Z_OK;
+    for (int level = Z_DEFAULT_COMPRESSION; rc != Z_STREAM_END; level = 0)
+    {
+        if (deflateReset(zs) != Z_OK) return FS_EFWRITE;
+        if (deflateParams(zs, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return FS_EFWRITE;
+        zs->next_in = b->data;
+        zs->avail_in = (uInt)b->data_size;
+        zs->next_out = b->raw + BGZF_HEADER;
+        zs->avail_out = BGZF_MAX - BGZF_HEADER - BGZF_FOOTER;
+        rc = deflate(zs, Z_FINISH);
+        if (rc != Z_STREAM_END && level == 0) return FS_EFWRITE;
+    }
+
+    static unsigned char const header[BGZF_HEADER] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0};
+    b->raw_size = BGZF_MAX - zs->avail_out;
+    memcpy(b->raw, header, BGZF_HEADER);
+    b->raw[16] = (b->raw_size - 1) & 0xff;
+    b->raw[17] = ((b->raw_size - 1) >> 8) & 0xff;
+    unsigned char *footer = b->raw + b->raw_size - BGZF_FOOTER;
+    _fs_put_le32(footer, (uint32_t)crc32(crc32(0, NULL, 0), b->data,
+                                         (uInt)b->data_size));
+    _fs_put_le32(footer + 4, (uint32_t)b->data_size);
+    return FS_OK;
+}
+
+static void *_fs_bgzf_worker(void *arg)
+{
+    struct zstream *z = arg;
+    z_stream zs = {0};
+    bool ok = z->writing ? deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                        -15, 8, Z_DEFAULT_STRATEGY) == Z_OK
+                         : inflateInit2(&zs, -15) == Z_OK;
+
+    pthread_mutex_lock(&z->lock);
+    while (true)
+    {
+        while (!z->stop && z->work == z->head)
+            pthread_cond_wait(&z->cond, &z->lock);
+        if (z->stop) break;
+        struct bgzf_block *b = &z->blocks[z->work++ % z->cap];
+        pthread_mutex_unlock(&z->lock);
+
+        if (!ok)
+            b->rc = FS_ENOMEM;
+        else if (z->writing)
+            b->rc = _fs_bgzf_deflate(&zs, b);
+        else
+            b->rc = _fs_bgzf_inflate(&zs, b);
+
+        pthread_mutex_lock(&z->lock);
+        b->done = true;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    if (ok && z->writing) deflateEnd(&zs);
+    if (ok && !z->writing) inflateEnd(&zs);
+    return NULL;
+}
+
+// Reads the next raw block; FS_OK with *eof set at a clean end of input.
+static int _fs_bgzf_load(struct zstream *z, struct bgzf_block *b, bool *eof)
+{
+    size_t n = _fs_zfread(z, b->raw, BGZF_HEADER);
+    if (n == 0 && !ferror(z->fp))
+    {
+        *eof = true;
+        return FS_OK;
+    }
+    if (n < BGZF_HEADER || _fs_codec_detect(b->raw, n) != FS_CODEC_BGZF)
+        return FS_EFREAD;
+
+    b->raw_size = (size_t)(b->raw[16] | b->raw[17] << 8) + 1;
+    if (b->raw_size < BGZF_HEADER + BGZF_FOOTER) return FS_EFREAD;
+    n = b->raw_size - BGZF_HEADER;
+    return _fs_zfread(z, b->raw + BGZF_HEADER, n) < n ? FS_EFREAD : FS_OK;
+}
+
+static void *_fs_bgzf_reader(void *arg)
+{
+    struct zstream *z = arg;
+
+    pthread_mutex_lock(&z->lock);
+    while (true)
+    {
+        while (!z->stop && z->head - z->tail == z->cap)
+            pthread_cond_wait(&z->cond, &z->lock);
+        if (z->stop) break;
+        struct bgzf_block *b = &z->blocks[z->head % z->cap];
+        pthread_mutex_unlock(&z->lock);
+
+        bool eof = false;
+        int rc = _fs_bgzf_load(z, b, &eof);
+
+        pthread_mutex_lock(&z->lock);
+        if (rc || eof)
+        {
+            z->rc = rc;
+            z->end = z->head;
+            pthread_cond_broadcast(&z->cond);
+            break;
+        }
+        b->done = false;
+        z->head += 1;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+}
+
+// Writes finished blocks in order until the stream is closed and drained.
+static void *_fs_bgzf_writer(void *arg)
+{
+    struct zstream *z = arg;
+    int rc = FS_OK;
+
+    pthread_mutex_lock(&z->lock);
+    while (true)
+    {
+        struct bgzf_block *b = &z->blocks[z->tail % z->cap];
+        while (!(z->tail < z->head && b->done) &&
+               !(z->closing && z->tail == z->head))
+            pthread_cond_wait(&z->cond, &z->lock);
+        if (z->tail == z->head) break;
+        pthread_mutex_unlock(&z->lock);
+
+        if (!rc) rc = b->rc;
+        if (!rc && fwrite(b->raw, 1, b->raw_size, z->fp) < b->raw_size)
+            rc = FS_EFWRITE;
+
+        pthread_mutex_lock(&z->lock);
+        if (rc && !z->rc) z->rc = rc;
+        z->tail += 1;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+}
+
+static void _fs_bgzf_stop(struct zstream *z)
+{
+    pthread_mutex_lock(&z->lock);
+    z->stop = true;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    for (int i = 0; i < z->nworkers; ++i)
+        pthread_join(z->workers[i], NULL);
+}
+
+static void _fs_bgzf_free(struct zstream *z)
+{
+    pthread_cond_destroy(&z->cond);
+    pthread_mutex_destroy(&z->lock);
+    free(z->workers);
+    free(z->blocks);
+}
+
+static int _fs_bgzf_init(struct zstream *z)
+{
+    if (!(z->block = malloc(sizeof(*z->block)))) return FS_ENOMEM;
+    z->block->data_size = 0;
+    int rc = z->writing ? deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION,
+                                       Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)
+                        : inflateInit2(&z->zs, -15);
+    if (rc != Z_OK)
+    {
+        free(z->block);
+        return FS_ENOMEM;
+    }
+    return FS_OK;
+}
+
+// Whether a stream on the caller's thread should move to the pipeline now.
+static bool _fs_bgzf_grow(struct zstream *z)
+{
+    return !z->nworkers && !z->rc && z->nblocks == BGZF_INLINE &&
+           _fs_nthreads(z->nthreads) > 1;
+}
+
+// Starts the pipeline. On failure the stream stays on the caller's thread.
+static int _fs_bgzf_start(struct zstream *z)
+{
+    int nthreads = _fs_nthreads(z->nthreads);
+    z->cap = (long)nthreads * BGZF_RING;
+    z->end = -1;
+    z->pos = 0;
+    z->blocks = malloc(z->cap * sizeof(*z->blocks));
+    z->workers = malloc(nthreads * sizeof(*z->workers));
+    if (!z->blocks || !z->workers)
+    {
+        free(z->blocks);
+        free(z->workers);
+        z->blocks = NULL;
+        z->workers = NULL;
+        return FS_ENOMEM;
+    }
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+
+    while (z->nworkers < nthreads &&
+           !pthread_create(&z->workers[z->nworkers], NULL, &_fs_bgzf_worker, z))
+        z->nworkers += 1;
+
+    void *(*io)(void *) = z->writing ? &_fs_bgzf_writer : &_fs_bgzf_reader;
+    if (z->nworkers == 0 || pthread_create(&z->io, NULL, io, z))
+    {
+        _fs_bgzf_stop(z);
+        _fs_bgzf_free(z);
+        z->nworkers = 0;
+        z->stop = false;
+        z->blocks = NULL;
+        z->workers = NULL;
+        return FS_ENOMEM;
+    }
+    return FS_OK;
+}
+
+static ssize_t _fs_bgzf_read(struct zstream *z, char *buf, size_t size)
+{
+    size_t n = 0;
+    int rc = FS_OK;
+
+    struct bgzf_block *b = z->block;
+    while (n < size && !z->nworkers)
+    {
+        if (z->pos == b->data_size)
+        {
+            if (z->eof) break;
+            if (_fs_bgzf_grow(z) && !_fs_bgzf_start(z)) break;
+            bool eof = false;
+            rc = _fs_bgzf_load(z, b, &eof);
+            if (!rc && !eof) rc = _fs_bgzf_inflate(&z->zs, b);
+            z->pos = 0;
+            if (rc || eof)
+            {
+                z->rc = rc;
+                z->eof = true;
+                b->data_size = 0;
+                break;
+            }
+            if (b->data_size > 0) z->nblocks += 1;
+            continue;
+        }
+
+        size_t len = b->data_size - z->pos;
+        if (len > size - n) len = size - n;
+        memcpy(buf + n, b->data + z->pos, len);
+        n += len;
+        z->pos += len;
+    }
+    if (!z->nworkers) return z->rc && n == 0 ? -1 : (ssize_t)n;
+
+    pthread_mutex_lock(&z->lock);
+    while (n < size)
+    {
+        b = &z->blocks[z->tail % z->cap];
+        while (z->tail != z->end && !(z->tail < z->head && b->done))
+            pthread_cond_wait(&z->cond, &z->lock);
+        if (z->tail == z->end)
+        {
+            rc = z->rc;
+            break;
+        }
+        if ((rc = b->rc)) break;
+        pthread_mutex_unlock(&z->lock);
+
+        size_t len = b->data_size - z->pos;
+        if (len > size - n) len = size - n;
+        memcpy(buf + n, b->data + z->pos, len);
+        n += len;
+        z->pos += len;
+
+        pthread_mutex_lock(&z->lock);
+        if (z->pos == b->data_size)
+        {
+            z->pos = 0;
+            z->tail += 1;
+            pthread_cond_broadcast(&z->cond);
+        }
+    }
+    pthread_mutex_unlock(&z->lock);
+    return rc && n == 0 ? -1 : (ssize_t)n;
+}
+
+// Deflates and writes out the block filled on the caller's thread.
+static int _fs_bgzf_flush(struct zstream *z)
+{
+    struct bgzf_block *b = z->block;
+    int rc = _fs_bgzf_deflate(&z->zs, b);
+    if (!rc && fwrite(b->raw, 1, b->raw_size, z->fp) < b->raw_size)
+        rc = FS_EFWRITE;
+    b->data_size = 0;
+    z->nblocks += 1;
+    return rc;
+}
+
+// Hands the block being filled over to the workers.
+static void _fs_bgzf_publish(struct zstream *z)
+{
+    pthread_mutex_lock(&z->lock);
+    z->blocks[z->head % z->cap].done = false;
+    z->head += 1;
+    z->filling = false;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+}
+
+static ssize_t _fs_bgzf_write(struct zstream *z, char const *buf, size_t size)
+{
+    size_t n = 0;
+    while (n < size)
+    {
+        if (_fs_bgzf_grow(z)) _fs_bgzf_start(z);
+        struct bgzf_block *b = z->block;
+        if (z->nworkers)
+        {
+            if (!z->filling)
+            {
+                pthread_mutex_lock(&z->lock);
+                while (!z->rc && z->head - z->tail == z->cap)
+                    pthread_cond_wait(&z->cond, &z->lock);
+                int rc = z->rc;
+                pthread_mutex_unlock(&z->lock);
+                if (rc) return 0;
+                z->blocks[z->head % z->cap].data_size = 0;
+                z->filling = true;
+            }
+            b = &z->blocks[z->head % z->cap];
+        }
+        else if (z->rc)
+            return 0;
+
+        size_t len = BGZF_BLOCK - b->data_size;
+        if (len > size - n) len = size - n;
+        memcpy(b->data + b->data_size, buf + n, len);
+        b->data_size += len;
+        n += len;
+
+        if (b->data_size < BGZF_BLOCK) continue;
+        if (z->nworkers)
+            _fs_bgzf_publish(z);
+        else
+            z->rc = _fs_bgzf_flush(z);
+    }
+    return (ssize_t)n;
+}
+
+static int _fs_bgzf_close(struct zstream *z)
+{
+    static unsigned char const eof[] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C',
+        2,    0,    0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+    if (z->writing && z->nworkers)
+    {
+        // Write out the partial block, then the empty end-of-file block.
+        if (z->filling && z->blocks[z->head % z->cap].data_size > 0)
+            _fs_bgzf_publish(z);
+        pthread_mutex_lock(&z->lock);
+        z->closing = true;
+        pthread_cond_broadcast(&z->cond);
+        pthread_mutex_unlock(&z->lock);
+        pthread_join(z->io, NULL);
+        _fs_bgzf_stop(z);
+    }
+    else if (z->writing && !z->rc && z->block->data_size > 0)
+        z->rc = _fs_bgzf_flush(z);
+    else if (z->nworkers)
+    {
+        _fs_bgzf_stop(z);
+        pthread_join(z->io, NULL);
+    }
+
+    if (z->writing && !z->rc &&
+        fwrite(eof, 1, sizeof(eof), z->fp) < sizeof(eof))
+        z->rc = FS_EFWRITE;
+    if (z->nworkers) _fs_bgzf_free(z);
+    if (z->writing)
+        deflateEnd(&z->zs);
+    else
+        inflateEnd(&z->zs);
+    free(z->block);
+    return z->rc;
+}
+
+static struct codec const gzip_codec = {&_fs_gzip_open, &_fs_gzip_read, NULL,
+                                        &_fs_gzip_close};
+static struct codec const bgzf_codec = {&_fs_bgzf_init, &_fs_bgzf_read,
+                                        &_fs_bgzf_write, &_fs_bgzf_close};
+#endif
+
+static struct codec const *codecs[FS_CODEC_BGZF + 1] = {
+    [FS_CODEC_NONE] = &raw_codec,
+#ifdef FS_WITH_ZLIB
+    [FS_CODEC_GZIP] = &gzip_codec,
+    [FS_CODEC_BGZF] = &bgzf_codec,
+#endif
+};
+
+static ssize_t _fs_zread(void *cookie, char *buf, size_t size)
+{
+    struct zstream *z = cookie;
+    return codecs[z->codec]->read(z, buf, size);
+}
+
+static ssize_t _fs_zwrite(void *cookie, char const *buf, size_t size)
+{
+    struct zstream *z = cookie;
+    return codecs[z->codec]->write(z, buf, size);
+}
+
+static int _fs_zclose(void *cookie)
+{
+    struct zstream *z = cookie;
+    int rc = codecs[z->codec]->close(z);
+    if (fclose(z->fp) && !rc) rc = FS_EFCLOSE;
+    free(z);
+    return rc ? EOF : 0;
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+static int _fs_zread_bsd(void *cookie, char *buf, int size)
+{
+    return (int)_fs_zread(cookie, buf, (size_t)size);
+}
+
+static int _fs_zwrite_bsd(void *cookie, char const *buf, int size)
+{
+    return (int)_fs_zwrite(cookie, buf, (size_t)size);
+}
+#endif
+
+static FILE *_fs_zfile(struct zstream *z, bool writing)
+{
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    return funopen(z, writing ? NULL : &_fs_zread_bsd,
+                   writing ? &_fs_zwrite_bsd : NULL, NULL, &_fs_zclose);
+#elif defined(__linux__)
+    cookie_io_functions_t io = {writing ? NULL : &_fs_zread,
+                                writing ? &_fs_zwrite : NULL, NULL,
+                                &_fs_zclose};
+    return fopencookie(z, writing ? "w" : "r", io);
+#else
+    (void)z;
+    (void)writing;
+    return NULL;
+#endif
+}
+
+static bool _fs_has_suffix(char const *str, char const *suffix)
+{
+    size_t n = strlen(str);
+    size_t m = strlen(suffix);
+    return n >= m && !strcmp(str + n - m, suffix);
+}
+
+// Takes ownership of fp, which it closes on failure. The n bytes at probe have
+// already been read from fp and are replayed first.
+static int _fs_zstream(FILE *fp, int codec, bool writing,
+                       unsigned char const *probe, size_t n, int nthreads,
+                       FILE **out)
+{
+    if (!codecs[codec])
+    {
+        fclose(fp);
+        return FS_ECODEC;
+    }
+
+    struct zstream *z = calloc(1, sizeof(*z));
+    if (!z)
+    {
+        fclose(fp);
+        return FS_ENOMEM;
+    }
+    z->fp = fp;
+    if (n > 0) memcpy(z->probe, probe, n);
+    z->nprobe = n;
+    z->codec = codec;
+    z->nthreads = nthreads;
+    z->writing = writing;
+
+    int rc = codecs[codec]->open(z);
+    if (rc)
+    {
+        fclose(fp);
+        free(z);
+        return rc;
+    }
+
+    if (!(*out = _fs_zfile(z, writing)))
+    {
+        _fs_zclose(z);
+        return FS_ECODEC;
+    }
+    return FS_OK;
+}
+
+static int _fs_zcreate(char const *filepath, int codec, FILE **out)
+{
+    FILE *fp = fopen(filepath, "wb");
+    if (!fp) return FS_EFOPEN;
+    return _fs_zstream(fp, codec, true, NULL, 0, 0, out);
+}
+
+// A strict open fails with FS_ECODEC on input it cannot decode. Otherwise such
+// input, and input whose first member does not inflate, is read as is.
+static int _fs_zopen(char const *filepath, char const *mode, FILE **out,
+                     int *codec, int how, int nthreads)
+{
+    bool writing = mode[0] != 'r' || strchr(mode, '+');
+    *codec = FS_CODEC_NONE;
+    *out = NULL;
+
+    if (writing ? !_fs_has_suffix(filepath, ".gz") &&
+                      !_fs_has_suffix(filepath, ".bgz")
+                : how == ZOPEN_RAW)
+        return (*out = fopen(filepath, mode)) ? FS_OK : FS_EFOPEN;
+
+    FILE *fp = fopen(filepath, mode);
+    if (!fp) return FS_EFOPEN;
+
+    if (writing)
+    {
+        *codec = FS_CODEC_BGZF;
+        return _fs_zstream(fp, *codec, true, NULL, 0, nthreads, out);
+    }
+    return _fs_zdecode(fp, out, codec, how, nthreads);
+}
+
+// Takes ownership of fp, which is read from its current position.
+static int _fs_zdecode(FILE *fp, FILE **out, int *codec, int how,
+                       int nthreads)
+{
+    bool strict = how == ZOPEN_STRICT;
+    *codec = FS_CODEC_NONE;
+    *out = NULL;
+
+    unsigned char probe[ZPROBE];
+    size_t n = fread(probe, 1, sizeof(probe), fp);
+    if (ferror(fp))
+    {
+        fclose(fp);
+        return FS_EFREAD;
+    }
+    *codec = _fs_codec_detect(probe, n);
+    if (!strict && !codecs[*codec]) *codec = FS_CODEC_NONE;
+#ifdef FS_WITH_ZLIB
+    if (!strict && *codec != FS_CODEC_NONE &&
+        !_fs_gzip_probe(probe, n, n < sizeof(probe)))
+        *codec = FS_CODEC_NONE;
+#endif
+
+    // Plain input that can be rewound needs no decoding layer at all.
+    if (*codec == FS_CODEC_NONE && fseeko(fp, 0, SEEK_SET) == 0)
+    {
+        *out = fp;
+        return FS_OK;
+    }
+    return _fs_zstream(fp, *codec, false, probe, n, nthreads, out);
+}
+
+int fs_zopen(char const *filepath, char const *mode, int nthreads, FILE **out)
+{
+    int codec = FS_CODEC_NONE;
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_ZOPEN, t,
+                     _fs_zopen(filepath, mode, out, &codec, ZOPEN_STRICT,
+                               nthreads));
+}
+
+int fs_zdetect(char const *filepath, int *codec)
+{
+    unsigned char magic[ZMAGIC] = {0};
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) return FS_EFOPEN;
+
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    if (ferror(fp))
+    {
+        fclose(fp);
+        return FS_EFREAD;
+    }
+    *codec = _fs_codec_detect(magic, n);
+    return fclose(fp) ? FS_EFCLOSE : FS_OK;
+}
+
+// Parallel line processing. The input is cut into newline-aligned chunks of
+// about chunk_size bytes that worker threads claim in order. Each worker owns
+// an emit buffer and, optionally, a reducer state from init that is handed to
+// reduce once it runs out of chunks. When an output stream is given, finished
+// chunks are parked in a window of slots and written strictly in input order
+// by whichever worker takes the flushing role. It writes without holding the
+// lock, so the others keep claiming and mapping chunks; workers only stop
+// claiming while the window is full. Input that cannot be mapped in memory is
+// streamed instead: the claiming worker reads the next chunk into its own
+// buffer and carries any trailing partial line over to the next claim.
+#define MAP_CHUNK (4L * 1024 * 1024)
+#define MAP_WINDOW 4
+
+struct fs_emit
+{
+    char *data;
+    long size;
+    long cap;
+};
+
+static int _fs_emit_reserve(struct fs_emit *e, long size)
+{
+    if (e->size + size <= e->cap) return FS_OK;
+    long cap = e->cap ? 2 * e->cap : BUFFSIZE;
+    while (cap < e->size + size)
+        cap *= 2;
+    void *ptr = realloc(e->data, cap);
+    if (!ptr) return FS_ENOMEM;
+    e->data = ptr;
+    e->cap = cap;
+    return FS_OK;
+}
+
+int fs_emit(struct fs_emit *e, char const *data, long size)
+{
+    if (size < 0) return FS_EINVAL;
+    int rc = _fs_emit_reserve(e, size);
+    if (rc) return rc;
+    if (size > 0) memcpy(e->data + e->size, data, size);
+    e->size += size;
+    return FS_OK;
+}
+
+struct fs_mapjob
+{
+    struct fs_mapper const *m;
+    char const *data;
+    long size;
+    FILE *fp;
+    bool eof;
+    struct fs_emit carry;
+    long chunk;
+    int window;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long cursor;
+    long claimed;
+    long written;
+    struct fs_emit *slots;
+    bool *ready;
+    bool flushing;
+    int rc;
+};
+
+static void _fs_map_fail(struct fs_mapjob *j, int rc)
+{
+    if (!j->rc) j->rc = rc;
+    pthread_cond_broadcast(&j->cond);
+}
+
+// Must be called with the job lock held, which is dropped around each write.
+// Slots that become ready meanwhile are picked up by the flusher in charge.
+static void _fs_map_flush(struct fs_mapjob *j)
+{
+    if (j->flushing) return;
+    j->flushing = true;
+
+    while (!j->rc && j->ready[j->written % j->window])
+    {
+        // The slot cannot be reused until written moves past it.
+        struct fs_emit *e = &j->slots[j->written % j->window];
+        pthread_mutex_unlock(&j->lock);
+        bool ok = e->size == 0 ||
+                  fwrite(e->data, 1, e->size, j->m->out) == (size_t)e->size;
+        pthread_mutex_lock(&j->lock);
+
+        if (!ok) _fs_map_fail(j, FS_EFWRITE);
+        e->size = 0;
+        j->ready[j->written % j->window] = false;
+        j->written += 1;
+        pthread_cond_broadcast(&j->cond);
+    }
+    j->flushing = false;
+}
+
+static int _fs_map_chunk(struct fs_mapper const *m, char const *p, long n,
+                         struct fs_emit *e, void *local)
+{
+    char const *end = p + n;
+    while (p < end)
+    {
+        char const *nl = memchr(p, '\n', end - p);
+        long len = nl ? nl - p : end - p;
+        int rc = m->map(p, len, e, local);
+        if (rc) return rc;
+        p += len + 1;
+    }
+    return FS_OK;
+}
+
+static bool _fs_map_more(struct fs_mapjob const *j)
+{
+    return j->fp ? !j->eof || j->carry.size > 0 : j->cursor < j->size;
+}
+
+// Must be called with the job lock held. Fills buf with the carried partial
+// line followed by whole chunks from the stream until it holds a newline, and
+// carries whatever follows the last one over to the next read.
+static int _fs_map_read(struct fs_mapjob *j, struct fs_emit *buf, long *size)
+{
+    buf->size = 0;
+    int rc = fs_emit(buf, j->carry.data, j->carry.size);
+    j->carry.size = 0;
+
+    long end = 0;
+    while (!rc && !j->eof)
+    {
+        if ((rc = _fs_emit_reserve(buf, j->chunk))) break;
+        size_t n = fread(buf->data + buf->size, 1, j->chunk, j->fp);
+        long scan = buf->size;
+        buf->size += (long)n;
+        if (n < (size_t)j->chunk)
+        {
+            if (ferror(j->fp)) rc = FS_EFREAD;
+            j->eof = true;
+            break;
+        }
+        for (long i = buf->size; i > scan && !end; --i)
+            if (buf->data[i - 1] == '\n') end = i;
+        if (end) break;
+    }
+    if (rc) return rc;
+
+    if (!end) end = buf->size;
+    rc = fs_emit(&j->carry, buf->data + end, buf->size - end);
+    j->cursor += end;
+    *size = end;
+    return rc;
+}
+
+static bool _fs_map_claim(struct fs_mapjob *j, struct fs_emit *buf, long *seq,
+                          char const **data, long *size)
+{
+    pthread_mutex_lock(&j->lock);
+    while (!j->rc && _fs_map_more(j) && j->m->out &&
+           j->claimed - j->written >= j->window)
+        pthread_cond_wait(&j->cond, &j->lock);
+
+    bool ok = !j->rc && _fs_map_more(j);
+    if (ok && j->fp)
+    {
+        int rc = _fs_map_read(j, buf, size);
+        if (rc) _fs_map_fail(j, rc);
+        ok = !rc;
+        *data = buf->data;
+    }
+    else if (ok)
+    {
+        long start = j->cursor;
+        long end = j->size - start > j->chunk ? start + j->chunk : j->size;
+        if (end < j->size)
+        {
+            char const *p = j->data + end - 1;
+            char const *nl = memchr(p, '\n', j->size - end + 1);
+            end = nl ? nl - j->data + 1 : j->size;
+        }
+        j->cursor = end;
+        *data = j->data + start;
+        *size = end - start;
+    }
+    if (ok) *seq = j->claimed++;
+    pthread_mutex_unlock(&j->lock);
+    return ok;
+}
+
+static void *_fs_map_worker(void *arg)
+{
+    struct fs_mapjob *j = arg;
+    struct fs_mapper const *m = j->m;
+    struct fs_emit emit = {0};
+    struct fs_emit buf = {0};
+    void *local = NULL;
+    int rc = FS_OK;
+
+    if (m->init && !(local = m->init(m->arg))) rc = FS_ENOMEM;
+
+    long seq = 0;
+    char const *data = NULL;
+    long size = 0;
+    while (!rc && _fs_map_claim(j, &buf, &seq, &data, &size))
+    {
+        emit.size = 0;
+        rc = _fs_map_chunk(m, data, size, &emit, local);
+        if (rc || !m->out) continue;
+
+        // Swap buffers with the slot so that its allocation gets reused.
+        pthread_mutex_lock(&j->lock);
+        struct fs_emit tmp = j->slots[seq % j->window];
+        j->slots[seq % j->window] = emit;
+        j->ready[seq % j->window] = true;
+        emit = tmp;
+        _fs_map_flush(j);
+        pthread_mutex_unlock(&j->lock);
+    }
+    free(emit.data);
+    free(buf.data);
+
+    pthread_mutex_lock(&j->lock);
+    if (local && m->reduce)
+    {
+        int r = m->reduce(local, m->arg);
+        if (!rc) rc = r;
+    }
+    if (rc) _fs_map_fail(j, rc);
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+static int _fs_map_run(struct fs_mapjob *j, int nthreads)
+{
+    struct fs_mapper const *m = j->m;
+    j->window = MAP_WINDOW * nthreads;
+
+    if (m->out)
+    {
+        j->slots = calloc(j->window, sizeof(*j->slots));
+        j->ready = calloc(j->window, sizeof(*j->ready));
+        if (!j->slots || !j->ready)
+        {
+            free(j->slots);
+            free(j->ready);
+            return FS_ENOMEM;
+        }
+    }
+
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    _fs_parallel(nthreads, &_fs_map_worker, j);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+
+    for (int i = 0; m->out && i < j->window; ++i)
+        free(j->slots[i].data);
+    free(j->slots);
+    free(j->ready);
+    free(j->carry.data);
+    return j->rc;
+}
+
+int fs_map_lines_mem(char const *data, long size, struct fs_mapper const *m)
+{
+    if (size < 0 || !m->map) return FS_EINVAL;
+
+    struct fs_mapjob j = {0};
+    j.m = m;
+    j.data = data;
+    j.size = size;
+    j.chunk = m->chunk_size > 0 ? m->chunk_size : MAP_CHUNK;
+
+    int nthreads = _fs_nthreads(m->nthreads);
+    if (nthreads > size / j.chunk + 1) nthreads = (int)(size / j.chunk + 1);
+    return _fs_map_run(&j, nthreads);
+}
+
+// Takes ownership of fd, whose input may be compressed or not seekable.
+static int _fs_map_stream(int fd, struct fs_mapper const *m, long *bytes)
+{
+    if (!m->map)
+    {
+        close(fd);
+        return FS_EINVAL;
+    }
+
+    FILE *raw = fdopen(fd, "rb");
+    if (!raw)
+    {
+        close(fd);
+        return FS_EFDOPEN;
+    }
+
+    struct fs_mapjob j = {0};
+    int codec = FS_CODEC_NONE;
+    int rc = _fs_zdecode(raw, &j.fp, &codec, ZOPEN_AUTO, 0);
+    if (rc) return rc;
+
+    j.m = m;
+    j.chunk = m->chunk_size > 0 ? m->chunk_size : MAP_CHUNK;
+    rc = _fs_map_run(&j, _fs_nthreads(m->nthreads));
+    if (fclose(j.fp) && !rc) rc = FS_EFCLOSE;
+    *bytes = j.cursor;
+    return rc;
+}
+
+static int _fs_map_lines(char const *filepath, struct fs_mapper const *m)
+{
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return FS_EOPEN;
+
+    struct stat st = {0};
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return FS_EFSTAT;
+    }
+
+    // Pipes and pseudo-files report no size, so only regular files with
+    // content are mapped in memory; the rest is streamed.
+    long bytes = 0;
+    int rc = FS_OK;
+    void *data = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return FS_EMMAP;
+        }
+        posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    }
+
+    if (data != MAP_FAILED &&
+        _fs_codec_detect(data, st.st_size) == FS_CODEC_NONE)
+    {
+        close(fd);
+        rc = fs_map_lines_mem(data, (long)st.st_size, m);
+        bytes = (long)st.st_size;
+    }
+    else
+        rc = _fs_map_stream(fd, m, &bytes);
+
+    if (!rc) STAT_ADD(FS_STAT_MAP_LINES, bytes, bytes);
+    if (data != MAP_FAILED) munmap(data, st.st_size);
+    return rc;
+}
+
+int fs_map_lines(char const *filepath, struct fs_mapper const *m)
+{
+    STAT_START(t);
+    return STAT_STOP(FS_STAT_MAP_LINES, t, _fs_map_lines(filepath, m));
+}
+
 // ACK: BusyBox
 static char *last_char_is(const char *s, int c)
 {
@@ -8,11 +8,14 @@
 #define FS_MAP(X)                                                              \
     X(OK, "not an error")                                                      \
     X(ECHMOD, "chmod failed")                                                  \
+    X(ECHOWN, "chown failed")                                                  \
     X(ECLOSE, "close failed")                                                  \
+    X(ECODEC, "codec not available")                                           \
     X(ECREAT, "creat failed")                                                  \
     X(EFCLOSE, "fclose failed")                                                \
     X(EFCNTL, "fcntl failed")                                                  \
     X(EFCOPYFILE, "fcopyfile failed")                                          \
+    X(EFDOPEN, "fdopen failed")                                                \
     X(EFGETS, "fgets failed")                                                  \
     X(EFILENO, "fileno failed")                                                \
     X(EFOPEN, "fopen failed")                                                  \
@@ -22,15 +25,26 @@
     X(EFSTAT, "fstat failed")                                                  \
     X(EFSYNC, "fsync failed")                                                  \
     X(EFTELL, "ftell failed")                                                  \
+    X(EFTRUNCATE, "ftruncate failed")                                          \
+    X(EFUTIMENS, "futimens failed")                                            \
     X(EFWRITE, "fwrite failed")                                                \
     X(EINVAL, "invalid value")                                                 \
+    X(ELINKAT, "linkat failed")                                                \
+    X(EMKDIR, "mkdir failed")                                                  \
     X(EMKSTEMP, "mkstemp failed")                                              \
+    X(EMMAP, "mmap failed")                                                    \
     X(ENOMEM, "not enough memory")                                             \
     X(EOPEN, "open failed")                                                    \
+    X(EOPENDIR, "opendir failed")                                              \
+    X(EPREAD, "pread failed")                                                  \
+    X(EPWRITE, "pwrite failed")                                                \
     X(EREADLINK, "readlink failed")                                            \
+    X(ERENAME, "rename failed")                                                \
     X(ERMDIR, "rmdir failed")                                                  \
     X(ESENDFILE, "sendfile failed")                                            \
     X(ESTAT, "stat failed")                                                    \
+    X(ESYMLINK, "symlink failed")                                              \
+    X(ESYNCFS, "syncfs failed")                                                \
     X(ETMPFILE, "tmpfile failed")                                              \
     X(ETRUNCPATH, "truncated path")                                            \
     X(EUNLINK, "unlink failed")
@@ -61,6 +75,96 @@ enum fs_algo
     FS_FLETCHER16,
 };
 
+enum fs_codec
+{
+    FS_CODEC_NONE,
+    FS_CODEC_GZIP,
+    FS_CODEC_BGZF,
+};
+
+enum fs_op
+{
+    FS_OP_UNLINK,
+    FS_OP_MOVE,
+    FS_OP_TOUCH,
+    FS_OP_SETPERM,
+};
+
+struct fs_batch_op
+{
+    int op;
+    char const *path;
+    char const *dst;
+    int who;
+    int perm;
+    bool value;
+};
+
+#define FS_STAT_MAP(X)                                                         \
+    X(BATCH, "fs_batch")                                                       \
+    X(CKSUM, "fs_cksum")                                                       \
+    X(COPY, "fs_copy")                                                         \
+    X(COPY_FCOPYFILE, "fs_copy:fcopyfile")                                     \
+    X(COPY_SENDFILE, "fs_copy:sendfile")                                       \
+    X(COPY_FP, "fs_copy_fp")                                                   \
+    X(DURABLE_COMMIT, "fs_durable_commit")                                     \
+    X(JOIN, "fs_join")                                                         \
+    X(LJOIN, "fs_ljoin")                                                       \
+    X(MAP_LINES, "fs_map_lines")                                               \
+    X(MOVE, "fs_move")                                                         \
+    X(READALL, "fs_readall")                                                   \
+    X(READLINES, "fs_readlines")                                               \
+    X(RJOIN, "fs_rjoin")                                                       \
+    X(SORT, "fs_sort")                                                         \
+    X(SORT_READ, "fs_sort:read")                                               \
+    X(SORT_QSORT, "fs_sort:qsort")                                             \
+    X(SORT_WRITE, "fs_sort:write")                                             \
+    X(SPLIT, "fs_split")                                                       \
+    X(TMPFILE, "fs_tmpfile")                                                   \
+    X(WRITEALL, "fs_writeall")                                                 \
+    X(WRITELINES, "fs_writelines")                                             \
+    X(ZOPEN, "fs_zopen")
+
+enum fs_stat_id
+{
+#define X(A, _) FS_STAT_##A,
+    FS_STAT_MAP(X)
+#undef X
+    FS_STAT_SIZE,
+};
+
+#define FS_STAT_BUCKETS 40
+#define FS_STAT_UNMEASURED UINT64_MAX
+
+struct fs_stat
+{
+    char const *name;
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t syscalls;
+    uint64_t nanoseconds;
+    uint64_t latency[FS_STAT_BUCKETS];
+};
+
+struct fs_stats
+{
+    struct fs_stat op[FS_STAT_SIZE];
+};
+
+struct fs_emit;
+
+struct fs_mapper
+{
+    int (*map)(char const *line, long size, struct fs_emit *, void *local);
+    void *(*init)(void *arg);
+    int (*reduce)(void *local, void *arg);
+    void *arg;
+    FILE *out;
+    int nthreads;
+    long chunk_size;
+};
+
 int fs_size(char const *filepath, long *size);
 int fs_size_fp(FILE *fp, long *size);
 int fs_size_fd(int fd, long *size);
@@ -78,6 +182,12 @@ int fs_rmdir(char const *dirpath);
 int fs_mkstemp(unsigned size, char *filepath);
 int fs_move(char const *restrict dst, char const *restrict src);
 
+int fs_tmpfile(char const *dirpath, int *fd);
+int fs_tmplink(int fd, char const *filepath);
+int fs_tmppool_get(FILE **fp);
+int fs_tmppool_put(FILE *fp);
+void fs_tmppool_clear(void);
+
 int fs_refopen(FILE *fp, char const *mode, FILE **out);
 int fs_fileno(FILE *fp, int *fd);
 int fs_getpath(FILE *fp, unsigned size, char *filepath);
@@ -87,6 +197,7 @@ bool fs_isdir(char const *path);
 int fs_touch(char const *filepath);
 
 int fs_readall(char const *filepath, long *size, unsigned char **data);
+int fs_readall_raw(char const *filepath, long *size, unsigned char **data);
 int fs_writeall(char const *filepath, long size, unsigned char *data);
 
 char const *fs_strerror(int rc);
@@ -94,6 +205,7 @@ char const *fs_strerror(int rc);
 int fs_join(FILE *a, FILE *b, FILE *out);
 int fs_split(FILE *in, long cut, FILE *a, FILE *b);
 int fs_readlines(char const *filepath, long *cnt, char **lines[]);
+int fs_readlines_raw(char const *filepath, long *cnt, char **lines[]);
 int fs_writelines(char const *filepath, long cnt, char *lines[]);
 
 int fs_ljoin(FILE *left, FILE *right);
@@ -101,5 +213,29 @@ int fs_rjoin(FILE *left, FILE *right);
 
 int fs_sort(char const *filepath);
 int fs_cksum(char const *filepath, int algo, long *chk);
+int fs_cksum_raw(char const *filepath, int algo, long *chk);
+
+struct fs_durable;
+
+int fs_durable_begin(struct fs_durable **);
+int fs_durable_writeall(struct fs_durable *, char const *filepath, long size,
+                        unsigned char *data);
+int fs_durable_writelines(struct fs_durable *, char const *filepath,
+                          long cnt, char *lines[]);
+int fs_durable_commit(struct fs_durable *);
+void fs_durable_abort(struct fs_durable *);
+
+int fs_zopen(char const *filepath, char const *mode, int nthreads, FILE **out);
+int fs_zdetect(char const *filepath, int *codec);
+
+int fs_map_lines(char const *filepath, struct fs_mapper const *);
+int fs_map_lines_mem(char const *data, long size, struct fs_mapper const *);
+int fs_emit(struct fs_emit *, char const *data, long size);
+
+int fs_stats_snapshot(struct fs_stats *);
+void fs_stats_reset(void);
+
+int fs_batch(long cnt, struct fs_batch_op const ops[], int nthreads,
+             int rcs[]);
 
 #endif
@@ -1,10 +1,27 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "fs.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef FS_WITH_ZLIB
+#include <zlib.h>
+#endif
+
 inline static void print_ctx(char const *func, char const *file, int line)
 {
     fprintf(stderr, "\n%s failed at %s:%d\n", func, file, line);
@@ -22,6 +39,13 @@ inline static void print_ctx(char const *func, char const *file, int line)
 
 static void test_cksum(void);
 static void test_join(void);
+static void test_durable(void);
+static void test_tmpfile(void);
+static void test_batch(void);
+static void test_stats(void);
+static void test_codec(void);
+static void test_move(void);
+static void test_map_lines(void);
 
 int main(void)
 {
@@ -71,6 +95,13 @@ int main(void)
 
     test_cksum();
     test_join();
+    test_durable();
+    test_tmpfile();
+    test_batch();
+    test_stats();
+    test_codec();
+    test_move();
+    test_map_lines();
 
     return 0;
 }
@@ -126,3 +157,635 @@ static void test_join(void)
     ASSERT(!fs_cksum("output.txt", FS_FLETCHER16, &chk));
     ASSERT(chk == 26780);
 }
+
+static void test_durable(void)
+{
+    static char *lines[] = {"first", "second\n", "third"};
+    unsigned char data[] = "durable";
+    struct fs_durable *d = NULL;
+
+    ASSERT(!fs_durable_begin(&d));
+    ASSERT(!fs_durable_writeall(d, "durable1.txt", 7, data));
+    ASSERT(!fs_durable_writelines(d, "./durable2.txt", 3, lines));
+    ASSERT(!fs_exists("durable1.txt"));
+    ASSERT(!fs_exists("durable2.txt"));
+    ASSERT(!fs_durable_commit(d));
+
+    long size = 0;
+    unsigned char *out = NULL;
+    ASSERT(!fs_readall("durable1.txt", &size, &out));
+    ASSERT(size == 7 && !memcmp(out, data, 7));
+    free(out);
+
+    long cnt = 0;
+    char **got = NULL;
+    ASSERT(!fs_readlines("durable2.txt", &cnt, &got));
+    ASSERT(cnt == 3 && !strcmp(got[2], "third\n"));
+    for (long i = 0; i < cnt; ++i)
+        free(got[i]);
+    free(got);
+
+    ASSERT(!fs_durable_begin(&d));
+    ASSERT(!fs_durable_writeall(d, "durable3.txt", 7, data));
+    fs_durable_abort(d);
+    ASSERT(!fs_exists("durable3.txt"));
+
+    struct stat st = {0};
+    ASSERT(!chmod("durable1.txt", 0755));
+    ASSERT(!fs_durable_begin(&d));
+    ASSERT(!fs_durable_writeall(d, "durable1.txt", 7, data));
+    ASSERT(!fs_durable_commit(d));
+    ASSERT(!stat("durable1.txt", &st));
+    ASSERT((st.st_mode & 07777) == 0755);
+
+    ASSERT(!fs_unlink("durable1.txt"));
+    ASSERT(!fs_unlink("durable2.txt"));
+}
+
+static bool has_tmpfile(char const *dirpath)
+{
+#ifdef O_TMPFILE
+    int fd = open(dirpath, O_TMPFILE | O_RDWR, 0600);
+    if (fd < 0) return false;
+    close(fd);
+    return true;
+#else
+    (void)dirpath;
+    return false;
+#endif
+}
+
+static void test_tmpfile(void)
+{
+    int fd = -1;
+    ASSERT(!fs_tmpfile(".", &fd));
+    ASSERT(write(fd, "anonymous", 9) == 9);
+    if (fs_exists("linked.txt")) fs_unlink("linked.txt");
+    if (has_tmpfile("."))
+    {
+        ASSERT(!fs_tmplink(fd, "linked.txt"));
+        long size = 0;
+        ASSERT(!fs_size("linked.txt", &size));
+        ASSERT(size == 9);
+        ASSERT(!fs_unlink("linked.txt"));
+    }
+    else
+        ASSERT(fs_tmplink(fd, "linked.txt") == FS_EINVAL);
+    close(fd);
+
+    FILE *fp = NULL;
+    ASSERT(!fs_tmppool_get(&fp));
+    ASSERT(fputs("pooled", fp) >= 0);
+    ASSERT(!fs_tmppool_put(fp));
+    ASSERT(!fs_tmppool_get(&fp));
+    long size = -1;
+    ASSERT(!fs_size_fp(fp, &size));
+    ASSERT(size == 0);
+    ASSERT(!fs_tmppool_put(fp));
+    fs_tmppool_clear();
+}
+
+static void test_batch(void)
+{
+    enum { CNT = 100 };
+    static char src[CNT][32];
+    static char dst[CNT][32];
+    static struct fs_batch_op ops[CNT];
+    static int rcs[CNT];
+
+    ASSERT(!mkdir("batch.d", 0755) || fs_isdir("batch.d"));
+    for (int i = 0; i < CNT; ++i)
+    {
+        sprintf(src[i], "batch.d/%d.txt", i);
+        sprintf(dst[i], "batch.d/%d.moved", i);
+        ops[i] = (struct fs_batch_op){FS_OP_TOUCH, src[i], NULL, 0, 0, false};
+    }
+    ASSERT(!fs_batch(CNT, ops, 4, rcs));
+    for (int i = 0; i < CNT; ++i)
+        ASSERT(fs_exists(src[i]));
+
+    for (int i = 0; i < CNT; ++i)
+        ops[i] = (struct fs_batch_op){FS_OP_SETPERM, src[i], NULL,
+                                      FS_ALL,        FS_EXEC, true};
+    ASSERT(!fs_batch(CNT, ops, 4, rcs));
+    struct stat st = {0};
+    ASSERT(!stat(src[CNT - 1], &st) && (st.st_mode & S_IXOTH));
+
+    for (int i = 0; i < CNT; ++i)
+        ops[i] = (struct fs_batch_op){FS_OP_MOVE, src[i], dst[i], 0, 0, false};
+    ASSERT(!fs_batch(CNT, ops, 0, rcs));
+    ASSERT(!fs_exists(src[0]) && fs_exists(dst[0]));
+
+    for (int i = 0; i < CNT; ++i)
+        ops[i] = (struct fs_batch_op){FS_OP_UNLINK, dst[i], NULL, 0, 0, false};
+    ops[CNT / 2].path = "batch.d/missing.txt";
+    ASSERT(fs_batch(CNT, ops, 3, rcs) == FS_EUNLINK);
+    ASSERT(rcs[CNT / 2] == FS_EUNLINK && rcs[0] == FS_OK);
+    ASSERT(!fs_unlink(dst[CNT / 2]));
+    ASSERT(!fs_rmdir("batch.d"));
+}
+
+#ifdef FS_STATS
+static int stats_map(char const *line, long size, struct fs_emit *out,
+                     void *local)
+{
+    (void)line;
+    (void)size;
+    (void)out;
+    (void)local;
+    return FS_OK;
+}
+#endif
+
+static void test_stats(void)
+{
+    struct fs_stats st;
+    long chk = 0;
+
+    fs_stats_reset();
+    ASSERT(!fs_cksum("LICENSE", FS_FLETCHER16, &chk));
+    int rc = fs_stats_snapshot(&st);
+    struct fs_stat const *op = &st.op[FS_STAT_CKSUM];
+    ASSERT(!strcmp(op->name, "fs_cksum"));
+#ifdef FS_STATS
+    ASSERT(!rc);
+    ASSERT(op->calls == 1 && op->errors == 0 && op->bytes == 1069);
+    ASSERT(op->syscalls == FS_STAT_UNMEASURED);
+    uint64_t hits = 0;
+    for (int i = 0; i < FS_STAT_BUCKETS; ++i)
+        hits += op->latency[i];
+    ASSERT(hits == 1);
+
+    // Counters from every thread end up in the snapshot.
+    enum { CNT = 64 };
+    static char paths[CNT][32];
+    static struct fs_batch_op ops[CNT];
+    static int rcs[CNT];
+    for (int i = 0; i < CNT; ++i)
+    {
+        sprintf(paths[i], "stats%d.txt", i);
+        ops[i] = (struct fs_batch_op){FS_OP_TOUCH, paths[i], NULL, 0, 0, false};
+    }
+    ASSERT(!fs_batch(CNT, ops, 4, rcs));
+    for (int i = 0; i < CNT; ++i)
+        ops[i].op = FS_OP_UNLINK;
+    ASSERT(!fs_batch(CNT, ops, 4, rcs));
+    ASSERT(!fs_copy("output.txt", "LICENSE"));
+
+    int fd = -1;
+    FILE *fp = NULL;
+    struct fs_mapper m = {stats_map, NULL, NULL, NULL, NULL, 2, 0};
+    ASSERT(!fs_tmpfile(".", &fd));
+    close(fd);
+    ASSERT(!fs_zopen("LICENSE", "rb", 0, &fp));
+    fclose(fp);
+    ASSERT(!fs_map_lines("LICENSE", &m));
+
+    ASSERT(!fs_stats_snapshot(&st));
+    ASSERT(st.op[FS_STAT_BATCH].calls == 2);
+    ASSERT(st.op[FS_STAT_BATCH].syscalls == 3 * CNT);
+    ASSERT(st.op[FS_STAT_COPY].syscalls > 0);
+    ASSERT(st.op[FS_STAT_COPY].syscalls != FS_STAT_UNMEASURED);
+    ASSERT(st.op[FS_STAT_TMPFILE].calls == 1);
+    ASSERT(st.op[FS_STAT_TMPFILE].syscalls > 0);
+    ASSERT(st.op[FS_STAT_TMPFILE].syscalls != FS_STAT_UNMEASURED);
+    ASSERT(st.op[FS_STAT_ZOPEN].calls == 1);
+    ASSERT(st.op[FS_STAT_ZOPEN].syscalls == FS_STAT_UNMEASURED);
+    ASSERT(st.op[FS_STAT_MAP_LINES].calls == 1);
+    ASSERT(st.op[FS_STAT_MAP_LINES].bytes == 1069);
+#else
+    ASSERT(rc == FS_EINVAL);
+    ASSERT(op->calls == 0);
+#endif
+}
+
+static void *fifo_writer(void *arg)
+{
+    FILE *in = fopen(arg, "rb");
+    FILE *out = fopen("fifo.txt", "wb");
+    if (in && out) fs_copy_fp(out, in);
+    if (out) fclose(out);
+    if (in) fclose(in);
+    return NULL;
+}
+
+// Reads fifo.txt with fs_readall or fs_readlines while another thread copies
+// the raw bytes of src into it.
+static void read_fifo(char const *src, long *size, unsigned char **data,
+                      long *cnt, char **lines[])
+{
+    if (fs_exists("fifo.txt")) fs_unlink("fifo.txt");
+    ASSERT(!mkfifo("fifo.txt", 0600));
+    pthread_t thread;
+    ASSERT(!pthread_create(&thread, NULL, fifo_writer, (void *)src));
+    if (data) ASSERT(!fs_readall("fifo.txt", size, data));
+    if (lines) ASSERT(!fs_readlines("fifo.txt", cnt, lines));
+    pthread_join(thread, NULL);
+    ASSERT(!fs_unlink("fifo.txt"));
+}
+
+static void test_codec(void)
+{
+    int codec = -1;
+    ASSERT(!fs_zdetect("LICENSE", &codec));
+    ASSERT(codec == FS_CODEC_NONE);
+
+    // Pipes cannot be rewound after the magic bytes are sniffed.
+    long size = 0;
+    unsigned char *back = NULL;
+    ASSERT(!fs_writeall("output.txt", 4, (unsigned char *)"b\na\n"));
+    read_fifo("output.txt", &size, &back, NULL, NULL);
+    ASSERT(size == 4 && !memcmp(back, "b\na\n", 4));
+    free(back);
+
+    long cnt = 0;
+    char **lines = NULL;
+    read_fifo("output.txt", NULL, NULL, &cnt, &lines);
+    ASSERT(cnt == 2 && !strcmp(lines[0], "b\n") && !strcmp(lines[1], "a\n"));
+    free(lines[0]);
+    free(lines[1]);
+    free(lines);
+
+    // zstd is not supported: such input is plain bytes to every API.
+    unsigned char zst[] = {0x28, 0xb5, 0x2f, 0xfd, 'z'};
+    ASSERT(!fs_writeall("output.txt.zst", sizeof zst, zst));
+    ASSERT(!fs_zdetect("output.txt.zst", &codec));
+    ASSERT(codec == FS_CODEC_NONE);
+    ASSERT(!fs_readall("output.txt.zst", &size, &back));
+    ASSERT(size == sizeof zst && !memcmp(back, zst, sizeof zst));
+    free(back);
+    FILE *zfp = NULL;
+    ASSERT(!fs_zopen("output.txt.zst", "rb", 0, &zfp));
+    ASSERT(fgetc(zfp) == 0x28);
+    fclose(zfp);
+    ASSERT(!fs_unlink("output.txt.zst"));
+
+    // Only a valid gzip header counts, and a file that has one by chance is
+    // still plain input to the line and bulk APIs.
+    unsigned char bad[] = {0x1f, 0x8b, 7, 0, 0, 0, 0, 0, 0, 3, 'z', '\n'};
+    ASSERT(!fs_writeall("output.txt.bin", sizeof bad, bad));
+    ASSERT(!fs_zdetect("output.txt.bin", &codec));
+    ASSERT(codec == FS_CODEC_NONE);
+    bad[2] = 8;
+    bad[10] = 0xff;
+    ASSERT(!fs_writeall("output.txt.bin", sizeof bad, bad));
+    ASSERT(!fs_zdetect("output.txt.bin", &codec));
+    ASSERT(codec == FS_CODEC_GZIP);
+    ASSERT(!fs_readall("output.txt.bin", &size, &back));
+    ASSERT(size == sizeof bad && !memcmp(back, bad, sizeof bad));
+    free(back);
+    ASSERT(!fs_unlink("output.txt.bin"));
+
+#ifndef FS_WITH_ZLIB
+    // Input in a codec that is not compiled in is read as is.
+    unsigned char gz[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3, 'z'};
+    ASSERT(!fs_writeall("output.txt.gz", sizeof gz, gz));
+    ASSERT(!fs_zdetect("output.txt.gz", &codec));
+    ASSERT(codec == FS_CODEC_GZIP);
+    ASSERT(!fs_readall("output.txt.gz", &size, &back));
+    ASSERT(size == sizeof gz && !memcmp(back, gz, sizeof gz));
+    free(back);
+    ASSERT(fs_zopen("output.txt.gz", "rb", 0, &zfp) == FS_ECODEC);
+    ASSERT(!fs_unlink("output.txt.gz"));
+#endif
+
+#ifdef FS_WITH_ZLIB
+    enum { SIZE = 3 * 1024 * 1024 };
+    unsigned char *data = malloc(SIZE);
+    ASSERT(data);
+    for (long i = 0; i < SIZE; ++i)
+        data[i] = (i % 61 == 60) ? '\n' : (unsigned char)('a' + i * 7 % 26);
+
+    FILE *fp = NULL;
+    ASSERT(!fs_zopen("output.txt.gz", "wb", 4, &fp));
+    ASSERT(fwrite(data, 1, SIZE, fp) == SIZE);
+    ASSERT(!fclose(fp));
+    ASSERT(!fs_zdetect("output.txt.gz", &codec));
+    ASSERT(codec == FS_CODEC_BGZF);
+
+    back = malloc(SIZE + 1);
+    ASSERT(back);
+    ASSERT(!fs_zopen("output.txt.gz", "rb", 4, &fp));
+    ASSERT(fread(back, 1, SIZE + 1, fp) == SIZE && !memcmp(back, data, SIZE));
+    ASSERT(!fclose(fp));
+    free(back);
+
+    ASSERT(!fs_readall("output.txt.gz", &size, &back));
+    ASSERT(size == SIZE && !memcmp(back, data, SIZE));
+    free(back);
+
+    read_fifo("output.txt.gz", &size, &back, NULL, NULL);
+    ASSERT(size == SIZE && !memcmp(back, data, SIZE));
+    free(back);
+
+    ASSERT(!fs_readlines("output.txt.gz", &cnt, &lines));
+    ASSERT(cnt == (SIZE + 60) / 61);
+    ASSERT(strlen(lines[0]) == 61 && lines[0][60] == '\n');
+    for (long i = 0; i < cnt; ++i)
+        free(lines[i]);
+    free(lines);
+
+    long chk = 0;
+    long plain = 0;
+    ASSERT(!fs_writeall("output.txt", SIZE, data));
+    ASSERT(!fs_cksum("output.txt", FS_FLETCHER16, &plain));
+    ASSERT(!fs_cksum("output.txt.gz", FS_FLETCHER16, &chk));
+    ASSERT(chk == plain);
+
+    gzFile gz = gzopen("output.txt.gz", "wb");
+    ASSERT(gz);
+    ASSERT(gzwrite(gz, data, SIZE) == SIZE);
+    ASSERT(gzclose(gz) == Z_OK);
+    ASSERT(!fs_zdetect("output.txt.gz", &codec));
+    ASSERT(codec == FS_CODEC_GZIP);
+    ASSERT(!fs_cksum("output.txt.gz", FS_FLETCHER16, &chk));
+    ASSERT(chk == plain);
+
+    // The raw variants see the bytes as stored, as without a codec.
+    ASSERT(!fs_readall_raw("output.txt.gz", &size, &back));
+    long zsize = 0;
+    ASSERT(!fs_size("output.txt.gz", &zsize));
+    ASSERT(size == zsize && back[0] == 0x1f && back[1] == 0x8b);
+    free(back);
+    ASSERT(!fs_cksum_raw("output.txt.gz", FS_FLETCHER16, &chk));
+    ASSERT(chk != plain);
+    ASSERT(!fs_readlines_raw("output.txt.gz", &cnt, &lines));
+    ASSERT(cnt > 0 && (unsigned char)lines[0][0] == 0x1f);
+    for (long i = 0; i < cnt; ++i)
+        free(lines[i]);
+    free(lines);
+
+    ASSERT(!fs_zopen("output.txt.gz", "rb", 0, &fp));
+    FILE *a = fopen("output.txt", "wb");
+    FILE *b = fopen("output2.txt", "wb");
+    ASSERT(!fs_split(fp, 10, a, b));
+    fclose(b);
+    fclose(a);
+    fclose(fp);
+    ASSERT(!fs_size("output.txt", &size));
+    ASSERT(size == 10 * 61);
+
+    // Sorting compressed input keeps it compressed.
+    ASSERT(!fs_readall("assets/unsorted.txt", &size, &back));
+    gz = gzopen("output.txt.gz", "wb");
+    ASSERT(gz);
+    ASSERT(gzwrite(gz, back, (unsigned)size) == size);
+    ASSERT(gzclose(gz) == Z_OK);
+    free(back);
+    ASSERT(!fs_sort("output.txt.gz"));
+    ASSERT(!fs_zdetect("output.txt.gz", &codec));
+    ASSERT(codec == FS_CODEC_BGZF);
+    ASSERT(!fs_copy("output.txt", "assets/unsorted.txt"));
+    ASSERT(!fs_setperm("output.txt", FS_OWNER, FS_WRITE, true));
+    ASSERT(!fs_sort("output.txt"));
+    ASSERT(!fs_cksum("output.txt", FS_FLETCHER16, &plain));
+    ASSERT(!fs_cksum("output.txt.gz", FS_FLETCHER16, &chk));
+    ASSERT(chk == plain);
+
+    // Write errors surface on fwrite or fclose, however many blocks fail.
+    if (fs_exists("/dev/full"))
+    {
+        ASSERT(!symlink("/dev/full", "full.gz"));
+        ASSERT(!fs_zopen("full.gz", "wb", 4, &fp));
+        for (int i = 0; i < 8 && fwrite(data, 1, SIZE, fp) == SIZE; ++i)
+            ;
+        ASSERT(fclose(fp) == EOF);
+        ASSERT(!fs_unlink("full.gz"));
+    }
+
+    free(data);
+    ASSERT(!fs_unlink("output.txt.gz"));
+    ASSERT(!fs_unlink("output2.txt"));
+#endif
+}
+
+static void check_moved_tree(char const *dir)
+{
+    char path[1024] = {0};
+    struct stat st = {0};
+    long chk = 0;
+    long expect = 0;
+
+    sprintf(path, "%s/sub/data.txt", dir);
+    ASSERT(!fs_cksum(path, FS_FLETCHER16, &chk));
+    ASSERT(!fs_cksum("assets/unsorted.txt", FS_FLETCHER16, &expect));
+    ASSERT(chk == expect);
+    ASSERT(!stat(path, &st));
+    ASSERT((st.st_mode & 0777) == 0640);
+    ASSERT(st.st_mtime == 1000000000);
+
+    if (geteuid() == 0) ASSERT(st.st_uid == 1234 && st.st_gid == 1234);
+
+    sprintf(path, "%s/link", dir);
+    char target[64] = {0};
+    ASSERT(readlink(path, target, sizeof(target) - 1) > 0);
+    ASSERT(!strcmp(target, "sub/data.txt"));
+    ASSERT(!lstat(path, &st));
+    if (geteuid() == 0) ASSERT(st.st_uid == 1234 && st.st_gid == 1234);
+
+    sprintf(path, "%s/sub", dir);
+    ASSERT(!stat(path, &st));
+    ASSERT((st.st_mode & 0777) == 0750);
+    if (geteuid() == 0) ASSERT(st.st_uid == 1234 && st.st_gid == 1234);
+}
+
+static void test_move(void)
+{
+    ASSERT(!mkdir("move.d", 0755));
+    ASSERT(!mkdir("move.d/sub", 0750));
+    ASSERT(!fs_copy("move.d/sub/data.txt", "assets/unsorted.txt"));
+    ASSERT(!chmod("move.d/sub/data.txt", 0640));
+    struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+    ASSERT(!utimensat(AT_FDCWD, "move.d/sub/data.txt", times, 0));
+    ASSERT(!symlink("sub/data.txt", "move.d/link"));
+    if (geteuid() == 0)
+    {
+        ASSERT(!chown("move.d/sub", 1234, 1234));
+        ASSERT(!chown("move.d/sub/data.txt", 1234, 1234));
+        ASSERT(!lchown("move.d/link", 1234, 1234));
+    }
+
+    ASSERT(!fs_move("moved.d", "move.d"));
+    ASSERT(!fs_exists("move.d"));
+    check_moved_tree("moved.d");
+
+    // Exercise the copying path when a second filesystem is at hand.
+    struct stat here = {0};
+    struct stat there = {0};
+    char const *other = "/dev/shm/fs-tests-move.d";
+    if (!stat(".", &here) && !stat("/dev/shm", &there) &&
+        here.st_dev != there.st_dev)
+    {
+        // An empty destination directory is replaced, as rename does.
+        ASSERT(!mkdir(other, 0700));
+        ASSERT(!fs_move(other, "moved.d"));
+        ASSERT(!fs_exists("moved.d"));
+        check_moved_tree(other);
+        ASSERT(!fs_move("moved.d", other));
+        ASSERT(!fs_exists(other));
+        check_moved_tree("moved.d");
+
+        // A non-empty one is not merged into.
+        char const *full = "/dev/shm/fs-tests-full.d";
+        ASSERT(!mkdir(full, 0700));
+        ASSERT(!fs_copy("/dev/shm/fs-tests-full.d/keep.txt", "LICENSE"));
+        ASSERT(fs_move(full, "moved.d") == FS_EMKDIR);
+        check_moved_tree("moved.d");
+        ASSERT(!fs_unlink("/dev/shm/fs-tests-full.d/keep.txt"));
+        ASSERT(!fs_rmdir(full));
+
+        // A tree that cannot be copied whole is left where it was.
+        ASSERT(!mkfifo("moved.d/fifo", 0600));
+        ASSERT(fs_move(other, "moved.d") == FS_EINVAL);
+        ASSERT(!fs_exists(other));
+        check_moved_tree("moved.d");
+        ASSERT(!fs_unlink("moved.d/fifo"));
+
+        // Batched moves fall back to copying too.
+        struct fs_batch_op op = {FS_OP_MOVE, "moved.d", other, 0, 0, false};
+        int rc = -1;
+        ASSERT(!fs_batch(1, &op, 2, &rc) && !rc);
+        check_moved_tree(other);
+        op = (struct fs_batch_op){FS_OP_MOVE, other, "moved.d", 0, 0, false};
+        ASSERT(!fs_batch(1, &op, 2, &rc) && !rc);
+        check_moved_tree("moved.d");
+
+        // An existing destination file is replaced whole.
+        char const *file = "/dev/shm/fs-tests-move.txt";
+        long chk = 0;
+        long expect = 0;
+        ASSERT(!fs_copy(file, "LICENSE"));
+        ASSERT(!fs_copy("output.txt", "assets/unsorted.txt"));
+        ASSERT(!fs_move(file, "output.txt"));
+        ASSERT(!fs_exists("output.txt"));
+        ASSERT(!fs_cksum(file, FS_FLETCHER16, &chk));
+        ASSERT(!fs_cksum("assets/unsorted.txt", FS_FLETCHER16, &expect));
+        ASSERT(chk == expect);
+        ASSERT(!fs_unlink(file));
+    }
+
+    ASSERT(!fs_unlink("moved.d/link"));
+    ASSERT(!fs_unlink("moved.d/sub/data.txt"));
+    ASSERT(!fs_rmdir("moved.d/sub"));
+    ASSERT(!fs_rmdir("moved.d"));
+}
+
+struct map_total
+{
+    long lines;
+    long bytes;
+};
+
+static void *map_init(void *arg)
+{
+    (void)arg;
+    return calloc(1, sizeof(struct map_total));
+}
+
+static int map_line(char const *line, long size, struct fs_emit *out,
+                    void *local)
+{
+    struct map_total *t = local;
+    t->lines += 1;
+    t->bytes += size;
+    if (size == 5 && !memcmp(line, "99999", 5)) return 42;
+    if (fs_emit(out, ">", 1)) return FS_ENOMEM;
+    if (fs_emit(out, line, size)) return FS_ENOMEM;
+    return fs_emit(out, "\n", 1);
+}
+
+static int map_reduce(void *local, void *arg)
+{
+    struct map_total *t = local;
+    struct map_total *sum = arg;
+    sum->lines += t->lines;
+    sum->bytes += t->bytes;
+    free(t);
+    return FS_OK;
+}
+
+static void test_map_lines(void)
+{
+    enum { CNT = 50000 };
+    FILE *fp = fopen("output.txt", "wb");
+    ASSERT(fp);
+    long bytes = 0;
+    for (int i = 0; i < CNT; ++i)
+        bytes += fprintf(fp, "%d\n", i) - 1;
+    fclose(fp);
+
+    struct map_total sum = {0};
+    FILE *out = fopen("output2.txt", "wb");
+    ASSERT(out);
+    struct fs_mapper m = {map_line, map_init, map_reduce, &sum, out, 4, 1000};
+    ASSERT(!fs_map_lines("output.txt", &m));
+    fclose(out);
+    ASSERT(sum.lines == CNT && sum.bytes == bytes);
+
+    long cnt = 0;
+    char **lines = NULL;
+    ASSERT(!fs_readlines("output2.txt", &cnt, &lines));
+    ASSERT(cnt == CNT);
+    for (long i = 0; i < cnt; ++i)
+    {
+        char expect[32] = {0};
+        sprintf(expect, ">%ld\n", i);
+        ASSERT(!strcmp(lines[i], expect));
+        free(lines[i]);
+    }
+    free(lines);
+
+    // Without an output stream emitted lines are dropped: the stream from
+    // the previous run must not grow.
+    long before = 0;
+    long after = 0;
+    ASSERT(!fs_size("output2.txt", &before));
+    memset(&sum, 0, sizeof(sum));
+    m.out = NULL;
+    ASSERT(!fs_map_lines("output.txt", &m));
+    ASSERT(sum.lines == CNT && sum.bytes == bytes);
+    ASSERT(!fs_size("output2.txt", &after));
+    ASSERT(after == before);
+
+    // Pipes have no size to map and are streamed, still in input order.
+    if (fs_exists("fifo.txt")) fs_unlink("fifo.txt");
+    ASSERT(!mkfifo("fifo.txt", 0600));
+    pthread_t thread;
+    ASSERT(!pthread_create(&thread, NULL, fifo_writer, "output.txt"));
+    memset(&sum, 0, sizeof(sum));
+    m.out = fopen("output3.txt", "wb");
+    ASSERT(m.out);
+    ASSERT(!fs_map_lines("fifo.txt", &m));
+    fclose(m.out);
+    pthread_join(thread, NULL);
+    ASSERT(!fs_unlink("fifo.txt"));
+    ASSERT(sum.lines == CNT && sum.bytes == bytes);
+    long chk2 = 0;
+    long chk3 = 0;
+    ASSERT(!fs_cksum("output2.txt", FS_FLETCHER16, &chk2));
+    ASSERT(!fs_cksum("output3.txt", FS_FLETCHER16, &chk3));
+    ASSERT(chk2 == chk3);
+    ASSERT(!fs_unlink("output3.txt"));
+    m.out = NULL;
+
+#ifdef FS_WITH_ZLIB
+    FILE *in = fopen("output.txt", "rb");
+    ASSERT(in);
+    ASSERT(!fs_zopen("output.txt.gz", "wb", 0, &fp));
+    ASSERT(!fs_copy_fp(fp, in));
+    ASSERT(!fclose(fp));
+    fclose(in);
+    memset(&sum, 0, sizeof(sum));
+    ASSERT(!fs_map_lines("output.txt.gz", &m));
+    ASSERT(sum.lines == CNT && sum.bytes == bytes);
+    ASSERT(!fs_unlink("output.txt.gz"));
+#endif
+
+    char const data[] = "1\n22\n99999\n4444";
+    memset(&sum, 0, sizeof(sum));
+    ASSERT(fs_map_lines_mem(data, sizeof(data) - 1, &m) == 42);
+    m.map = NULL;
+    ASSERT(fs_map_lines_mem(data, sizeof(data) - 1, &m) == FS_EINVAL);
+
+    ASSERT(!fs_unlink("output2.txt"));
+}